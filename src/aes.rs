@@ -18,9 +18,25 @@ const SBOX: [[u8;16];16] = [/*  0     1     2     3     4     5     6     7
                         /*C*/ [0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a],
                         /*D*/ [0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e],
                         /*E*/ [0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf],
-                        /*F*/ [0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x10],
+                        /*F*/ [0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16],
 ]; 
 
+// The inverse substitution box for the software decryption fallback, computed at compile
+// time by inverting SBOX so the two tables can never disagree.
+const INV_SBOX: [u8;256] = {
+    let mut inv = [0u8;256];
+    let mut row = 0;
+    while row < 16 {
+        let mut col = 0;
+        while col < 16 {
+            inv[SBOX[row][col] as usize] = ((row << 4) | col) as u8;
+            col += 1;
+        }
+        row += 1;
+    }
+    inv
+};
+
 // These are the round constants for the AES key expansion algorithm. Source: "NIST.FIPS.197-upd1.pdf"
 const RCON: [u32;10] = [0x01000000, 0x02000000, 0x04000000, 0x08000000, 0x10000000, 0x20000000, 0x40000000, 0x80000000, 0x1b000000, 0x36000000];
 
@@ -229,9 +245,10 @@ pub fn expand_key(key: &[u8;16]) -> [u8; 176] {
 
 
 
-// AES128 encryption
-fn encrypt_one_block_128(plaintext: [u8;16], key: &[u8;16]) -> [u8;16] {
-    // println!("plaintext at start: {:x?}", plaintext);
+/// Expands the key into the 11 round keys as 128 bit registers. Done once per payload,
+/// not once per block: on a 200MB download the expansion would otherwise run 12.5 million
+/// times for the exact same key.
+fn expand_round_keys(key: &[u8;16]) -> [__m128i; 11] {
     let exp_key = expand_key(key);
     let mut round_keys: [__m128i;11] = unsafe { [_mm_setzero_si128();11] };
     let mut i = 0;
@@ -239,113 +256,238 @@ fn encrypt_one_block_128(plaintext: [u8;16], key: &[u8;16]) -> [u8;16] {
     while i < exp_key.len()-15 {
         let temp = array16_from_slice(&exp_key[i..i+16]);
         let round_key = unsafe { _mm_loadu_si128(temp.as_ptr() as *const __m128i) };
-        
+
         round_keys[i/16] = round_key;
         i += 16;
     }
+    round_keys
+}
+
+/// Round keys for the equivalent inverse cipher. Rounds 1 through 9 need InvMixColumns
+/// applied to their round key, which is done once here instead of once per round per block.
+fn expand_decrypt_round_keys(key: &[u8;16]) -> [__m128i; 11] {
+    let mut round_keys = expand_round_keys(key);
+    for i in 1..10 {
+        round_keys[i] = unsafe { _mm_aesimc_si128(round_keys[i]) };
+    }
+    round_keys
+}
+
+// AES128 encryption of one block with the AES-NI instructions. Caller must have checked
+// that the cpu supports them.
+#[target_feature(enable = "aes")]
+unsafe fn encrypt_one_block_128_hw(plaintext: [u8;16], round_keys: &[__m128i;11]) -> [u8;16] {
+
+    let plaintext = _mm_loadu_si128(plaintext.as_ptr() as *const __m128i);
+
+    let mut ciphertext = _mm_xor_si128(plaintext, round_keys[0]);
 
-    // The main body of the AES128 algorithm starts here
-    let plaintext = unsafe { _mm_loadu_si128(plaintext.as_ptr() as *const __m128i) };
-    
-    // { // This is a SIMD print statement
-    //     let mut value: [u8;16] = [0;16];
-    //     unsafe { _mm_storeu_si128(value.as_mut_ptr() as *mut __m128i, plaintext) };
-    //     println!("Plaintext as _m128i: {:x?}", value);
-    // }
-
-    let mut ciphertext = unsafe { _mm_xor_si128(plaintext, round_keys[0]) };
-    // { // This is a SIMD print statement
-    //     let mut value: [u8;16] = [0;16];
-    //     unsafe { _mm_storeu_si128(value.as_mut_ptr() as *mut __m128i, ciphertext) };
-    //     println!("state0: {:x?}", value);
-    // }
-    
-    
     let mut i = 1;
     while i < 10 {
-        ciphertext = unsafe { _mm_aesenc_si128(ciphertext, round_keys[i]) };
-        // { // This is a SIMD print statement
-        //     let mut value: [u8;16] = [0;16];
-        //     unsafe { _mm_storeu_si128(value.as_mut_ptr() as *mut __m128i, ciphertext) };
-        //     println!("state{i}: {:x?}", value);
-        // }
-        
+        ciphertext = _mm_aesenc_si128(ciphertext, round_keys[i]);
         i += 1;
     }
-    ciphertext = unsafe { _mm_aesenclast_si128(ciphertext, round_keys[10]) };
-    // { // This is a SIMD print statement
-    //     let mut value: [u8;16] = [0;16];
-    //     unsafe { _mm_storeu_si128(value.as_mut_ptr() as *mut __m128i, ciphertext) };
-    //     println!("state10: {:x?}", value);
-    // }
-   
+    ciphertext = _mm_aesenclast_si128(ciphertext, round_keys[10]);
+
     let mut value: [u8;16] = [0;16];
-    unsafe { _mm_storeu_si128(value.as_mut_ptr() as *mut __m128i, ciphertext) };
+    _mm_storeu_si128(value.as_mut_ptr() as *mut __m128i, ciphertext);
 
     value
 }
 
+// Expects round keys from expand_decrypt_round_keys, i.e. already passed through aesimc.
+#[target_feature(enable = "aes")]
+unsafe fn decrypt_one_block_128_hw(ciphertext: [u8;16], round_keys: &[__m128i;11]) -> [u8;16] {
 
-fn decrypt_one_block_128(ciphertext: [u8;16], key: &[u8;16]) -> [u8;16] {
-    let exp_key = expand_key(key);
-    let mut round_keys: [__m128i;11] = unsafe { [_mm_setzero_si128();11] };
-    let mut i = 0;
-    // putting the expanded key into an array of 128bit words
-    while i < exp_key.len()-15 {
-        let temp = array16_from_slice(&exp_key[i..i+16]);
-        // println!("Round key {i}: {:x?}", temp);
-        let round_key = unsafe { _mm_loadu_si128(temp.as_ptr() as *const __m128i) };
-        
-        round_keys[i/16] = round_key;
-        i += 16;
-    }
+    let ciphertext = _mm_loadu_si128(ciphertext.as_ptr() as *const __m128i);
+
+    let mut plaintext = _mm_xor_si128(ciphertext, round_keys[10]);
 
-    // The main body of the AES128 algorithm
-    let ciphertext = unsafe { _mm_loadu_si128(ciphertext.as_ptr() as *const __m128i) };
-   
-    let mut plaintext = unsafe { _mm_xor_si128(ciphertext, round_keys[10]) };
-    // { // This is a SIMD print statement
-    //     let mut value: [u8;16] = [0;16];
-    //     unsafe { _mm_storeu_si128(value.as_mut_ptr() as *mut __m128i, plaintext) };
-    //     println!("state10: {:x?}", value);
-    // }
-    // println!("Going into loop");
-    
     for i in 1..10 {
-        let round_key = unsafe { _mm_aesimc_si128(round_keys[10-i]) };
-        plaintext = unsafe { _mm_aesdec_si128(plaintext, round_key) };
-        // {// This is a SIMD print statement
-        //     let mut value: [u8;16] = [0;16];
-        //     unsafe { _mm_storeu_si128(value.as_mut_ptr() as *mut __m128i, plaintext) };
-        //     println!("state{}: {:x?}", 10-i, value);
-        // }
-        
+        plaintext = _mm_aesdec_si128(plaintext, round_keys[10-i]);
     }
-    plaintext = unsafe { _mm_aesdeclast_si128(plaintext, round_keys[0]) };
-    // {// This is a SIMD print statement
-    //     let mut value: [u8;16] = [0;16];
-    //     unsafe { _mm_storeu_si128(value.as_mut_ptr() as *mut __m128i, plaintext) };
-    //     println!("state0: {:x?}", value);
-    // }
-   
+    plaintext = _mm_aesdeclast_si128(plaintext, round_keys[0]);
+
     let mut value: [u8;16] = [0;16];
-    unsafe { _mm_storeu_si128(value.as_mut_ptr() as *mut __m128i, plaintext) };
+    _mm_storeu_si128(value.as_mut_ptr() as *mut __m128i, plaintext);
     value
 }
 
+// ############### SOFTWARE FALLBACK ###########################################################
+// The table-based cipher below is only used when the cpu has no AES instructions. It is the
+// round functions straight out of "NIST.FIPS.197-upd1.pdf" with the state kept as the usual
+// 16 byte array where byte 4*column + row is state[row][column].
+
+fn sub_byte(b: u8) -> u8 {
+    SBOX[(b >> 4) as usize][(b & 0x0f) as usize]
+}
+
+fn inv_sub_byte(b: u8) -> u8 {
+    INV_SBOX[b as usize]
+}
+
+// Multiplication by x in GF(2^8) modulo the AES polynomial.
+fn xtime(b: u8) -> u8 {
+    (b << 1) ^ if b & 0x80 != 0 { 0x1b } else { 0x00 }
+}
+
+// General multiplication in GF(2^8), only needed for InvMixColumns.
+fn gf_mult(mut a: u8, mut b: u8) -> u8 {
+    let mut product = 0;
+    while b != 0 {
+        if b & 1 != 0 {
+            product ^= a;
+        }
+        a = xtime(a);
+        b >>= 1;
+    }
+    product
+}
+
+fn add_round_key(state: &mut [u8;16], round_key: &[u8]) {
+    for i in 0..16 {
+        state[i] ^= round_key[i];
+    }
+}
+
+fn shift_rows(state: &mut [u8;16]) {
+    // Row r (bytes r, r+4, r+8, r+12) is rotated left by r positions.
+    for row in 1..4 {
+        let mut rotated = [0u8;4];
+        for col in 0..4 {
+            rotated[col] = state[4*((col + row) % 4) + row];
+        }
+        for col in 0..4 {
+            state[4*col + row] = rotated[col];
+        }
+    }
+}
+
+fn inv_shift_rows(state: &mut [u8;16]) {
+    for row in 1..4 {
+        let mut rotated = [0u8;4];
+        for col in 0..4 {
+            rotated[(col + row) % 4] = state[4*col + row];
+        }
+        for col in 0..4 {
+            state[4*col + row] = rotated[col];
+        }
+    }
+}
+
+fn mix_columns(state: &mut [u8;16]) {
+    for col in 0..4 {
+        let a0 = state[4*col];
+        let a1 = state[4*col + 1];
+        let a2 = state[4*col + 2];
+        let a3 = state[4*col + 3];
+        state[4*col]     = xtime(a0) ^ xtime(a1) ^ a1 ^ a2 ^ a3;
+        state[4*col + 1] = a0 ^ xtime(a1) ^ xtime(a2) ^ a2 ^ a3;
+        state[4*col + 2] = a0 ^ a1 ^ xtime(a2) ^ xtime(a3) ^ a3;
+        state[4*col + 3] = xtime(a0) ^ a0 ^ a1 ^ a2 ^ xtime(a3);
+    }
+}
+
+fn inv_mix_columns(state: &mut [u8;16]) {
+    for col in 0..4 {
+        let a0 = state[4*col];
+        let a1 = state[4*col + 1];
+        let a2 = state[4*col + 2];
+        let a3 = state[4*col + 3];
+        state[4*col]     = gf_mult(a0, 0x0e) ^ gf_mult(a1, 0x0b) ^ gf_mult(a2, 0x0d) ^ gf_mult(a3, 0x09);
+        state[4*col + 1] = gf_mult(a0, 0x09) ^ gf_mult(a1, 0x0e) ^ gf_mult(a2, 0x0b) ^ gf_mult(a3, 0x0d);
+        state[4*col + 2] = gf_mult(a0, 0x0d) ^ gf_mult(a1, 0x09) ^ gf_mult(a2, 0x0e) ^ gf_mult(a3, 0x0b);
+        state[4*col + 3] = gf_mult(a0, 0x0b) ^ gf_mult(a1, 0x0d) ^ gf_mult(a2, 0x09) ^ gf_mult(a3, 0x0e);
+    }
+}
+
+fn encrypt_one_block_128_soft(plaintext: [u8;16], exp_key: &[u8;176]) -> [u8;16] {
+    let mut state = plaintext;
+    add_round_key(&mut state, &exp_key[0..16]);
+    for round in 1..10 {
+        for i in 0..16 {
+            state[i] = sub_byte(state[i]);
+        }
+        shift_rows(&mut state);
+        mix_columns(&mut state);
+        add_round_key(&mut state, &exp_key[16*round..16*round + 16]);
+    }
+    for i in 0..16 {
+        state[i] = sub_byte(state[i]);
+    }
+    shift_rows(&mut state);
+    add_round_key(&mut state, &exp_key[160..176]);
+    state
+}
+
+fn decrypt_one_block_128_soft(ciphertext: [u8;16], exp_key: &[u8;176]) -> [u8;16] {
+    let mut state = ciphertext;
+    add_round_key(&mut state, &exp_key[160..176]);
+    for round in (1..10).rev() {
+        inv_shift_rows(&mut state);
+        for i in 0..16 {
+            state[i] = inv_sub_byte(state[i]);
+        }
+        add_round_key(&mut state, &exp_key[16*round..16*round + 16]);
+        inv_mix_columns(&mut state);
+    }
+    inv_shift_rows(&mut state);
+    for i in 0..16 {
+        state[i] = inv_sub_byte(state[i]);
+    }
+    add_round_key(&mut state, &exp_key[0..16]);
+    state
+}
+
+// ############### END OF SOFTWARE FALLBACK ####################################################
+
+// AES128 encryption of one block. Picks the AES-NI path when the cpu has it. Bulk callers
+// should use encrypt_128, which expands the key once for the whole payload.
+fn encrypt_one_block_128(plaintext: [u8;16], key: &[u8;16]) -> [u8;16] {
+    if std::arch::is_x86_feature_detected!("aes") {
+        let round_keys = expand_round_keys(key);
+        unsafe { encrypt_one_block_128_hw(plaintext, &round_keys) }
+    } else {
+        let exp_key = expand_key(key);
+        encrypt_one_block_128_soft(plaintext, &exp_key)
+    }
+}
+
+
+fn decrypt_one_block_128(ciphertext: [u8;16], key: &[u8;16]) -> [u8;16] {
+    if std::arch::is_x86_feature_detected!("aes") {
+        let round_keys = expand_decrypt_round_keys(key);
+        unsafe { decrypt_one_block_128_hw(ciphertext, &round_keys) }
+    } else {
+        let exp_key = expand_key(key);
+        decrypt_one_block_128_soft(ciphertext, &exp_key)
+    }
+}
+
 
 pub fn encrypt_128(data: &[u8], key: &[u8;16]) -> Vec<u8> {
 
     let data = pkcs_pad16(data);
-    let mut output: Vec<u8> = Vec::new();
-    
-
+    let mut output: Vec<u8> = Vec::with_capacity(data.len());
 
-    let mut i = 0;
-    while i < data.len() {
-        let temp = encrypt_one_block_128(array16_from_slice(&data[i..i+16]), key);
-        output.extend_from_slice(&temp);
-        i += 16;
+    // The cpu feature check and the key expansion happen once out here, so the per-block
+    // loop is nothing but cipher rounds.
+    if std::arch::is_x86_feature_detected!("aes") {
+        let round_keys = expand_round_keys(key);
+        let mut i = 0;
+        while i < data.len() {
+            let temp = unsafe { encrypt_one_block_128_hw(array16_from_slice(&data[i..i+16]), &round_keys) };
+            output.extend_from_slice(&temp);
+            i += 16;
+        }
+    } else {
+        let exp_key = expand_key(key);
+        let mut i = 0;
+        while i < data.len() {
+            let temp = encrypt_one_block_128_soft(array16_from_slice(&data[i..i+16]), &exp_key);
+            output.extend_from_slice(&temp);
+            i += 16;
+        }
     }
 
     output
@@ -356,12 +498,23 @@ pub fn encrypt_128(data: &[u8], key: &[u8;16]) -> Vec<u8> {
 pub fn decrypt_128(data: &[u8], key: &[u8;16]) -> Vec<u8> {
     let data = pkcs_pad16(data);
     let mut output: Vec<u8> = Vec::with_capacity(data.len() + 1);
-    
-    let mut i = 0;
-    while i < data.len() {
-        let temp = decrypt_one_block_128(array16_from_slice(&data[i..i+16]), key);
-        output.extend_from_slice(&temp);
-        i += 16;
+
+    if std::arch::is_x86_feature_detected!("aes") {
+        let round_keys = expand_decrypt_round_keys(key);
+        let mut i = 0;
+        while i < data.len() {
+            let temp = unsafe { decrypt_one_block_128_hw(array16_from_slice(&data[i..i+16]), &round_keys) };
+            output.extend_from_slice(&temp);
+            i += 16;
+        }
+    } else {
+        let exp_key = expand_key(key);
+        let mut i = 0;
+        while i < data.len() {
+            let temp = decrypt_one_block_128_soft(array16_from_slice(&data[i..i+16]), &exp_key);
+            output.extend_from_slice(&temp);
+            i += 16;
+        }
     }
 
     pkcs_unpad(output)
@@ -483,6 +636,23 @@ mod tests {
         assert_eq!(encrypt_one_block_128(Plaintext, &Key), Ciphertext);
     }
 
+    #[test]
+    fn test_software_fallback_matches_standard() {
+        // The software path must produce the exact same bytes as the AES-NI path, so it is
+        // checked against the same NIST vector regardless of what cpu the tests run on.
+        let Plaintext: [u8;16] = [0x32, 0x43, 0xf6, 0xa8, 0x88, 0x5a, 0x30, 0x8d, 0x31, 0x31, 0x98, 0xa2, 0xe0, 0x37, 0x07, 0x34];
+        let Key: [u8;16] = [0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c];
+        let Ciphertext: [u8;16] = [
+            0x39, 0x25, 0x84, 0x1d,
+            0x02, 0xdc, 0x09, 0x0fb,
+            0xdc, 0x11, 0x85, 0x97,
+            0x19, 0x6a, 0x0b, 0x32
+        ];
+        let exp_key = expand_key(&Key);
+        assert_eq!(encrypt_one_block_128_soft(Plaintext, &exp_key), Ciphertext);
+        assert_eq!(decrypt_one_block_128_soft(Ciphertext, &exp_key), Plaintext);
+    }
+
     #[test]
     fn test_key_expansion() {
         //these keys are from the official NIST AES standard
@@ -572,4 +742,4 @@ mod tests {
         println!("a: {:b}", a);
         println!("c: {:b}", c);
     }
-}
\ No newline at end of file
+}
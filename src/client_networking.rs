@@ -2,49 +2,98 @@ use std::io::Write;
 use std::str::{self};
 
 use crate::auth::AuthenticationError;
+use crate::debug_println;
+use crate::db_structure::{ColumnTable, DbVec, StreamingBinaryParser};
 use crate::networking_utilities::*;
 
 
-pub fn download_table(address: &str, username: &str, password: &str, table_name: &str) -> Result<String, ServerError> {
+/// Downloads a table over an already established Connection. Can be called many times
+/// on the same Connection to pipeline requests over one encrypted session.
+pub fn download_table_on_connection(connection: &mut Connection, table_name: &str) -> Result<ColumnTable, ServerError> {
 
-    let mut connection = Connection::connect(address, username, password)?;
+    let response = instruction_send_and_confirm(Instruction::Download(table_name.to_owned()), connection)?;
+    debug_println!("Instruction successfully sent");
+    debug_println!("response: {}", response);
 
-    let response = instruction_send_and_confirm(Instruction::Download(table_name.to_owned()), &mut connection)?;
-    println!("Instruction successfully sent");
-    println!("response: {}", response);
-    
-    let csv: Vec<u8>;
-    match parse_response(&response, &connection.user, password.as_bytes(), table_name) {
-        Ok(_) => (csv, _) = receive_data(&mut connection)?,
+    let binary: Vec<u8>;
+    match parse_response(&response, &connection.user, &[], table_name) {
+        Ok(_) => (binary, _) = receive_data(connection)?,
         Err(e) => return Err(e),
     }
-    println!("received: {}", bytes_to_str(&csv)?);
+    debug_println!("received {} bytes", binary.len());
+
+    let table = ColumnTable::from_binary(&binary, table_name, &connection.user.clone())?;
 
     match connection.stream.write("OK".as_bytes()) {
-        Ok(n) => println!("Wrote 'OK' as {n} bytes"),
+        Ok(n) => debug_println!("Wrote 'OK' as {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));}
     };
     connection.stream.flush()?;
 
-    Ok(bytes_to_str(&csv)?.to_owned())
+    Ok(table)
 }
 
+pub fn download_table(address: &str, username: &str, password: &str, table_name: &str) -> Result<ColumnTable, ServerError> {
 
-pub fn upload_table(address: &str, username: &str, password: &str, table_name: &str, csv: &String) -> Result<String, ServerError> {
+    let mut connection = Connection::connect(address, username, password)?;
+    download_table_on_connection(&mut connection, table_name)
+}
+
+/// Downloads a table while parsing it as it arrives: every frame is decrypted and fed to
+/// an incremental parser, and on_column sees each typed column as soon as its bytes are
+/// complete - while the rest of the table is still on the wire. The raw payload never
+/// accumulates next to the parsed table, so peak memory is roughly the table itself plus
+/// one frame. Returns the finished table, validated the same way download_table's is.
+pub fn download_table_streaming_on_connection(connection: &mut Connection, table_name: &str, mut on_column: impl FnMut(&DbVec)) -> Result<ColumnTable, ServerError> {
+
+    let response = instruction_send_and_confirm(Instruction::Download(table_name.to_owned()), connection)?;
+    debug_println!("Instruction successfully sent");
+    debug_println!("response: {}", response);
+
+    let mut parser = StreamingBinaryParser::new();
+    match parse_response(&response, &connection.user, &[], table_name) {
+        Ok(_) => {
+            receive_data_streaming(connection, |chunk| {
+                parser.feed(chunk, &mut on_column).map_err(ServerError::Strict)
+            })?;
+        },
+        Err(e) => return Err(e),
+    }
+
+    let table = parser.finish(table_name, &connection.user.clone())?;
+
+    match connection.stream.write("OK".as_bytes()) {
+        Ok(n) => debug_println!("Wrote 'OK' as {n} bytes"),
+        Err(e) => {return Err(ServerError::Io(e.kind()));}
+    };
+    connection.stream.flush()?;
+
+    Ok(table)
+}
+
+pub fn download_table_streaming(address: &str, username: &str, password: &str, table_name: &str, on_column: impl FnMut(&DbVec)) -> Result<ColumnTable, ServerError> {
 
     let mut connection = Connection::connect(address, username, password)?;
+    download_table_streaming_on_connection(&mut connection, table_name, on_column)
+}
+
 
-    let response = instruction_send_and_confirm(Instruction::Upload(table_name.to_owned()), &mut connection)?;
+pub fn upload_table_on_connection(connection: &mut Connection, table_name: &str, csv: &str) -> Result<String, ServerError> {
 
-    println!("upload_table - parsing response");
-    let confirmation: String = match parse_response(&response, &connection.user, password.as_bytes(), table_name) {
-        Ok(_) => data_send_and_confirm(&mut connection, csv.as_bytes())?,
+    // The csv is only an import format. The wire carries the binary columnar encoding.
+    let table = ColumnTable::from_csv_string(csv, table_name, &connection.user.clone())?;
+    let binary = table.to_binary();
+
+    let response = instruction_send_and_confirm(Instruction::Upload(table_name.to_owned()), connection)?;
+
+    debug_println!("upload_table - parsing response");
+    let confirmation: String = match parse_response(&response, &connection.user, &[], table_name) {
+        Ok(_) => data_send_and_confirm(connection, &binary)?,
         Err(e) => return Err(e),
     };
-    println!("confirmation: {}", confirmation);
-    // The reason for the +28 in the length checker is that it accounts for the length of the nonce (IV) and the authentication tag
-    // in the aes-gcm encryption. The nonce is 12 bytes and the auth tag is 16 bytes
-    let data_len = (csv.len() + 28).to_string();
+    debug_println!("confirmation: {}", confirmation);
+    // The server confirms with the total plaintext length it received.
+    let data_len = binary.len().to_string();
     if confirmation == data_len {
         return Ok("OK".to_owned());
     } else {
@@ -53,75 +102,117 @@ pub fn upload_table(address: &str, username: &str, password: &str, table_name: &
 
 }
 
-
-pub fn update_table(address: &str, username: &str, password: &str, table_name: &str, csv: &str) -> Result<String, ServerError> {
+pub fn upload_table(address: &str, username: &str, password: &str, table_name: &str, csv: &String) -> Result<String, ServerError> {
 
     let mut connection = Connection::connect(address, username, password)?;
+    upload_table_on_connection(&mut connection, table_name, csv)
+}
+
+
+pub fn update_table_on_connection(connection: &mut Connection, table_name: &str, csv: &str) -> Result<String, ServerError> {
 
-    let response = instruction_send_and_confirm(Instruction::Update(table_name.to_owned()), &mut connection)?;
+    let response = instruction_send_and_confirm(Instruction::Update(table_name.to_owned()), connection)?;
 
-    let confirmation: String = match parse_response(&response, &connection.user, password.as_bytes(), table_name) {
-        Ok(_) => data_send_and_confirm(&mut connection, csv.as_bytes())?,
+    let confirmation: String = match parse_response(&response, &connection.user, &[], table_name) {
+        Ok(_) => data_send_and_confirm(connection, csv.as_bytes())?,
         Err(e) => return Err(e),
     };
 
-    // The reason for the +28 in the length checker is that it accounts for the length of the nonce (IV) and the authentication tag
-    // in the aes-gcm encryption. The nonce is 12 bytes and the auth tag is 16 bytes
-    let data_len = (csv.len() + 28).to_string();
+    // The server confirms with the total plaintext length it received.
+    let data_len = csv.len().to_string();
     if confirmation == data_len {
-        println!("Confirmation from server: {}", confirmation);
+        debug_println!("Confirmation from server: {}", confirmation);
         return Ok("OK".to_owned());
     } else {
-        println!("Confirmation from server: {}", confirmation);
+        debug_println!("Confirmation from server: {}", confirmation);
         return Err(ServerError::Confirmation(confirmation));
     }
 
 }
 
+pub fn update_table(address: &str, username: &str, password: &str, table_name: &str, csv: &str) -> Result<String, ServerError> {
 
-pub fn query_table(address: &str, username: &str, password: &str, table_name: &str, query: &str) -> Result<String, ServerError> {
-    
     let mut connection = Connection::connect(address, username, password)?;
+    update_table_on_connection(&mut connection, table_name, csv)
+}
 
-    let response = instruction_send_and_confirm(Instruction::Query(table_name.to_owned(), query.to_owned()), &mut connection)?;
+
+pub fn query_table_on_connection(connection: &mut Connection, table_name: &str, query: &str) -> Result<String, ServerError> {
+
+    let response = instruction_send_and_confirm(Instruction::Query(table_name.to_owned(), query.to_owned()), connection)?;
 
     let csv: Vec<u8>;
     match response.as_str() {
 
         // THIS IS WHERE YOU SEND THE BULK OF THE DATA
         //########## SUCCESS BRANCH #################################
-        "OK" => (csv, _) = receive_data(&mut connection)?,
+        "OK" => (csv, _) = receive_data(connection)?,
         //###########################################################
-        "Username is incorrect" => return Err(ServerError::Authentication(AuthenticationError::WrongUser(connection.user))),
-        "Password is incorrect" => return Err(ServerError::Authentication(AuthenticationError::WrongPassword(password.as_bytes().to_owned()))),
+        "Username is incorrect" => return Err(ServerError::Authentication(AuthenticationError::WrongUser(connection.user.clone()))),
+        "Password is incorrect" => return Err(ServerError::Authentication(AuthenticationError::WrongPassword(Vec::new()))),
         e => panic!("Need to handle error: {}", e),
     };
 
     match connection.stream.write("OK".as_bytes()) {
-        Ok(n) => println!("Wrote 'OK' as {n} bytes"),
+        Ok(n) => debug_println!("Wrote 'OK' as {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));}
     };
 
     Ok(bytes_to_str(&csv)?.to_owned())
 }
 
+pub fn query_table(address: &str, username: &str, password: &str, table_name: &str, query: &str) -> Result<String, ServerError> {
 
-pub fn kv_upload(address: &str, username: &str, password: &str, key: &str, value: &[u8]) -> Result<(), ServerError> {
+    let mut connection = Connection::connect(address, username, password)?;
+    query_table_on_connection(&mut connection, table_name, query)
+}
+
+/// Deletes the rows matching a primary key list ("key1,key2") or range ("start..end") from
+/// the named table on the server. Returns how many rows were deleted.
+pub fn delete_rows_on_connection(connection: &mut Connection, table_name: &str, query: &str) -> Result<usize, ServerError> {
+
+    let response = instruction_send_and_confirm(Instruction::Delete(table_name.to_owned(), query.to_owned()), connection)?;
+
+    let count: Vec<u8>;
+    match response.as_str() {
+        "OK" => (count, _) = receive_data(connection)?,
+        "Username is incorrect" => return Err(ServerError::Authentication(AuthenticationError::WrongUser(connection.user.clone()))),
+        "Password is incorrect" => return Err(ServerError::Authentication(AuthenticationError::WrongPassword(Vec::new()))),
+        e => panic!("Need to handle error: {}", e),
+    };
+
+    match connection.stream.write("OK".as_bytes()) {
+        Ok(n) => debug_println!("Wrote 'OK' as {n} bytes"),
+        Err(e) => {return Err(ServerError::Io(e.kind()));}
+    };
+
+    let count = bytes_to_str(&count)?.to_owned();
+    match count.parse::<usize>() {
+        Ok(n) => Ok(n),
+        Err(_) => Err(ServerError::Confirmation(count)),
+    }
+}
+
+pub fn delete_rows(address: &str, username: &str, password: &str, table_name: &str, query: &str) -> Result<usize, ServerError> {
 
     let mut connection = Connection::connect(address, username, password)?;
+    delete_rows_on_connection(&mut connection, table_name, query)
+}
+
 
-    let response = instruction_send_and_confirm(Instruction::KvUpload(key.to_owned()), &mut connection)?;
+pub fn kv_upload_on_connection(connection: &mut Connection, key: &str, value: &[u8]) -> Result<(), ServerError> {
 
-    println!("upload_value - parsing response");
-    let confirmation: String = match parse_response(&response, &connection.user, password.as_bytes(), key) {
-        Ok(_) => data_send_and_confirm(&mut connection, value)?,
+    let response = instruction_send_and_confirm(Instruction::KvUpload(key.to_owned()), connection)?;
+
+    debug_println!("upload_value - parsing response");
+    let confirmation: String = match parse_response(&response, &connection.user, &[], key) {
+        Ok(_) => data_send_and_confirm(connection, value)?,
         Err(e) => return Err(e),
     };
-    println!("value uploaded successfully");
+    debug_println!("value uploaded successfully");
 
-    // The reason for the +28 in the length checker is that it accounts for the length of the nonce (IV) and the authentication tag
-    // in the aes-gcm encryption. The nonce is 12 bytes and the auth tag is 16 bytes
-    let data_len = (value.len() + 28).to_string();
+    // The server confirms with the total plaintext length it received.
+    let data_len = value.len().to_string();
     if confirmation == data_len {
         return Ok(());
     } else {
@@ -129,45 +220,53 @@ pub fn kv_upload(address: &str, username: &str, password: &str, key: &str, value
     }
 }
 
-pub fn kv_download(address: &str, username: &str, password: &str, key: &str) -> Result<Vec<u8>, ServerError> {
+pub fn kv_upload(address: &str, username: &str, password: &str, key: &str, value: &[u8]) -> Result<(), ServerError> {
 
     let mut connection = Connection::connect(address, username, password)?;
+    kv_upload_on_connection(&mut connection, key, value)
+}
 
-    let response = instruction_send_and_confirm(Instruction::KvDownload(key.to_owned()), &mut connection)?;
+pub fn kv_download_on_connection(connection: &mut Connection, key: &str) -> Result<Vec<u8>, ServerError> {
+
+    let response = instruction_send_and_confirm(Instruction::KvDownload(key.to_owned()), connection)?;
 
     let value: Vec<u8>;
-    
-    match parse_response(&response, &connection.user, password.as_bytes(), key) {
-        Ok(_) => (value, _) = receive_data(&mut connection)?,
+
+    match parse_response(&response, &connection.user, &[], key) {
+        Ok(_) => (value, _) = receive_data(connection)?,
         Err(e) => return Err(e),
     }
 
 
     match connection.stream.write("OK".as_bytes()) {
-        Ok(n) => println!("Wrote 'OK' as {n} bytes"),
+        Ok(n) => debug_println!("Wrote 'OK' as {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));}
     };
 
     Ok(value)
 }
 
-pub fn kv_update(address: &str, username: &str, password: &str, key: &str, value: &[u8]) -> Result<(), ServerError> {
+pub fn kv_download(address: &str, username: &str, password: &str, key: &str) -> Result<Vec<u8>, ServerError> {
+
     let mut connection = Connection::connect(address, username, password)?;
+    kv_download_on_connection(&mut connection, key)
+}
+
+pub fn kv_update_on_connection(connection: &mut Connection, key: &str, value: &[u8]) -> Result<(), ServerError> {
 
-    let response = instruction_send_and_confirm(Instruction::KvUpdate(key.to_owned()), &mut connection)?;
+    let response = instruction_send_and_confirm(Instruction::KvUpdate(key.to_owned()), connection)?;
 
     let confirmation: String;
 
-    println!("upload_value - parsing response");
-    match parse_response(&response, &connection.user, password.as_bytes(), key) {
-        Ok(_) => confirmation = data_send_and_confirm(&mut connection, value)?,
+    debug_println!("upload_value - parsing response");
+    match parse_response(&response, &connection.user, &[], key) {
+        Ok(_) => confirmation = data_send_and_confirm(connection, value)?,
         Err(e) => return Err(e),
     }
-    println!("value uploaded successfully");
+    debug_println!("value uploaded successfully");
 
-    // The reason for the +28 in the length checker is that it accounts for the length of the nonce (IV) and the authentication tag
-    // in the aes-gcm encryption. The nonce is 12 bytes and the auth tag is 16 bytes
-    let data_len = (value.len() + 28).to_string();
+    // The server confirms with the total plaintext length it received.
+    let data_len = value.len().to_string();
     if confirmation == data_len {
         return Ok(());
     } else {
@@ -175,21 +274,25 @@ pub fn kv_update(address: &str, username: &str, password: &str, key: &str, value
     }
 }
 
-pub fn meta_list_tables(address: &str, username: &str, password: &str) -> Result<String, ServerError> {
+pub fn kv_update(address: &str, username: &str, password: &str, key: &str, value: &[u8]) -> Result<(), ServerError> {
     let mut connection = Connection::connect(address, username, password)?;
+    kv_update_on_connection(&mut connection, key, value)
+}
 
-    let response = instruction_send_and_confirm(Instruction::MetaListTables, &mut connection)?;
+pub fn meta_list_tables_on_connection(connection: &mut Connection) -> Result<String, ServerError> {
+
+    let response = instruction_send_and_confirm(Instruction::MetaListTables, connection)?;
 
     let value: Vec<u8>;
-    
-    match parse_response(&response, &connection.user, password.as_bytes(), "") {
-        Ok(_) => (value, _) = receive_data(&mut connection)?,
+
+    match parse_response(&response, &connection.user, &[], "") {
+        Ok(_) => (value, _) = receive_data(connection)?,
         Err(e) => return Err(e),
     }
-    println!("value downloaded successfully");
+    debug_println!("value downloaded successfully");
 
     match connection.stream.write("OK".as_bytes()) {
-        Ok(n) => println!("Wrote 'OK' as {n} bytes"),
+        Ok(n) => debug_println!("Wrote 'OK' as {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));}
     };
 
@@ -198,21 +301,25 @@ pub fn meta_list_tables(address: &str, username: &str, password: &str) -> Result
     Ok(table_list.to_owned())
 }
 
-pub fn meta_list_key_values(address: &str, username: &str, password: &str) -> Result<String, ServerError> {
+pub fn meta_list_tables(address: &str, username: &str, password: &str) -> Result<String, ServerError> {
     let mut connection = Connection::connect(address, username, password)?;
+    meta_list_tables_on_connection(&mut connection)
+}
 
-    let response = instruction_send_and_confirm(Instruction::MetaListKeyValues, &mut connection)?;
+pub fn meta_list_key_values_on_connection(connection: &mut Connection) -> Result<String, ServerError> {
+
+    let response = instruction_send_and_confirm(Instruction::MetaListKeyValues, connection)?;
 
     let value: Vec<u8>;
-    
-    match parse_response(&response, &connection.user, password.as_bytes(), "") {
-        Ok(_) => (value, _) = receive_data(&mut connection)?,
+
+    match parse_response(&response, &connection.user, &[], "") {
+        Ok(_) => (value, _) = receive_data(connection)?,
         Err(e) => return Err(e),
     }
-    println!("value downloaded successfully");
+    debug_println!("value downloaded successfully");
 
     match connection.stream.write("OK".as_bytes()) {
-        Ok(n) => println!("Wrote 'OK' as {n} bytes"),
+        Ok(n) => debug_println!("Wrote 'OK' as {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));}
     };
 
@@ -221,6 +328,110 @@ pub fn meta_list_key_values(address: &str, username: &str, password: &str) -> Re
     Ok(table_list.to_owned())
 }
 
+pub fn meta_list_key_values(address: &str, username: &str, password: &str) -> Result<String, ServerError> {
+    let mut connection = Connection::connect(address, username, password)?;
+    meta_list_key_values_on_connection(&mut connection)
+}
+
+/// Downloads the server's request statistics: instruction counts, bytes moved, and
+/// cumulative cycle counts for the parse, crypto, and handler stages. One "name|value"
+/// pair per line.
+pub fn meta_stats_on_connection(connection: &mut Connection) -> Result<String, ServerError> {
+
+    let response = instruction_send_and_confirm(Instruction::MetaStats, connection)?;
+
+    let value: Vec<u8>;
+
+    match parse_response(&response, &connection.user, &[], "") {
+        Ok(_) => (value, _) = receive_data(connection)?,
+        Err(e) => return Err(e),
+    }
+    debug_println!("value downloaded successfully");
+
+    match connection.stream.write("OK".as_bytes()) {
+        Ok(n) => debug_println!("Wrote 'OK' as {n} bytes"),
+        Err(e) => {return Err(ServerError::Io(e.kind()));}
+    };
+
+    let stats = bytes_to_str(&value)?;
+
+    Ok(stats.to_owned())
+}
+
+pub fn meta_stats(address: &str, username: &str, password: &str) -> Result<String, ServerError> {
+    let mut connection = Connection::connect(address, username, password)?;
+    meta_stats_on_connection(&mut connection)
+}
+
+/// Builder for a batched request. Queue operations in the order they should run, then
+/// submit them all in one round trip with batch_execute. The server returns one result
+/// per operation, in the same order: "OK" or a row count on success, an "ERROR: ..."
+/// string for the operations that failed (the rest of the batch still runs).
+pub struct Batch {
+    ops: Vec<BatchOp>,
+}
+
+impl Batch {
+    pub fn new() -> Batch {
+        Batch { ops: Vec::new() }
+    }
+
+    pub fn update(&mut self, table_name: &str, csv: &str) {
+        self.ops.push(BatchOp::Update(table_name.to_owned(), csv.to_owned()));
+    }
+
+    pub fn query(&mut self, table_name: &str, query: &str) {
+        self.ops.push(BatchOp::Query(table_name.to_owned(), query.to_owned()));
+    }
+
+    pub fn delete(&mut self, table_name: &str, query: &str) {
+        self.ops.push(BatchOp::Delete(table_name.to_owned(), query.to_owned()));
+    }
+
+    pub fn kv_update(&mut self, key: &str, value: &[u8]) {
+        self.ops.push(BatchOp::KvUpdate(key.to_owned(), Vec::from(value)));
+    }
+
+    pub fn len(&self) -> usize {
+        self.ops.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.ops.is_empty()
+    }
+}
+
+pub fn batch_execute_on_connection(connection: &mut Connection, batch: &Batch) -> Result<Vec<String>, ServerError> {
+
+    let response = instruction_send_and_confirm(Instruction::Batch, connection)?;
+
+    let payload = serialize_batch(&batch.ops);
+    let confirmation: String = match parse_response(&response, &connection.user, &[], "") {
+        Ok(_) => data_send_and_confirm(connection, &payload)?,
+        Err(e) => return Err(e),
+    };
+
+    // The server confirms with the total plaintext length it received.
+    if confirmation != payload.len().to_string() {
+        debug_println!("Confirmation from server: {}", confirmation);
+        return Err(ServerError::Confirmation(confirmation));
+    }
+
+    let (results, _) = receive_data(connection)?;
+
+    match connection.stream.write("OK".as_bytes()) {
+        Ok(n) => debug_println!("Wrote 'OK' as {n} bytes"),
+        Err(e) => {return Err(ServerError::Io(e.kind()));}
+    };
+
+    parse_batch_responses(&results)
+}
+
+pub fn batch_execute(address: &str, username: &str, password: &str, batch: &Batch) -> Result<Vec<String>, ServerError> {
+    let mut connection = Connection::connect(address, username, password)?;
+    batch_execute_on_connection(&mut connection, batch)
+}
+
 
 
 
@@ -306,7 +517,7 @@ mod tests {
         let table = download_table(address, username, password, name).unwrap();
         println!("{:?}", table);
         let good_table = ColumnTable::from_csv_string(&std::fs::read_to_string("good_csv.txt").unwrap(), "good_table", "test").unwrap();
-        assert_eq!(table, good_table.to_string());
+        assert_eq!(table.to_string(), good_table.to_string());
     }
 
     #[test]
@@ -1,4 +1,4 @@
-use std::{fmt::{self, Display, Debug}, io::Write, collections::BTreeMap};
+use std::{fmt::{self, Display, Debug}, io::Write, collections::HashMap, str};
 
 use smartstring::{SmartString, LazyCompact};
 
@@ -22,6 +22,8 @@ pub enum StrictError {
     TooManyPrimaryKeys,
     WrongKey,
     NonUniquePrimaryKey(usize),
+    BinaryFormat(usize),
+    Query(String),
 }
 
 impl fmt::Display for StrictError {
@@ -41,6 +43,8 @@ impl fmt::Display for StrictError {
             StrictError::TooManyPrimaryKeys => write!(f, "There can only be one primary key column"),
             StrictError::WrongKey => write!(f, "The type of the primary key is wrong"),
             StrictError::NonUniquePrimaryKey(i) => write!(f, "The primary key at position {i} in the sorted table is repeated"),
+            StrictError::BinaryFormat(i) => write!(f, "The binary table data is corrupt at byte {i}"),
+            StrictError::Query(s) => write!(f, "Invalid query: {s}"),
         }
     }
 }
@@ -57,6 +61,9 @@ pub struct Metadata {
     pub last_access: u64,
     pub times_accessed: u64,
     pub created_by: KeyString,
+    /// Mutation counter. Bumped by every write path so the background save loop can
+    /// skip tables that have not changed since they were last persisted.
+    pub times_modified: u64,
 }
 
 impl fmt::Display for Metadata {
@@ -65,6 +72,7 @@ impl fmt::Display for Metadata {
 
         printer.push_str(&format!("last_access:{}\n", self.last_access));
         printer.push_str(&format!("times_accessed:{}\n", self.times_accessed));
+        printer.push_str(&format!("times_modified:{}\n", self.times_modified));
         printer.push_str(&format!("created_by:{}", self.created_by));
         writeln!(f, "{}", printer)
     }
@@ -76,20 +84,102 @@ impl Metadata {
             last_access: get_current_time(),
             times_accessed: 0,
             created_by: KeyString::from(client),
+            times_modified: 0,
         }
     }
 }
 
 
+/// One cell of a StrictTable. The same shape as DbEntry except that text is a
+/// (start, length) span into the table's text arena instead of an owned String, which is
+/// what lets a whole row live as a flat Copy slice.
+#[derive(PartialEq, PartialOrd, Clone, Copy, Debug)]
+pub enum ArenaEntry {
+    Int(i64),
+    Float(f64),
+    Text(u32, u32),
+    Empty,
+}
+
+/// Copies text onto the end of the arena and returns its (start, length) span.
+fn intern(arena: &mut String, text: &str) -> (u32, u32) {
+    let start = arena.len() as u32;
+    arena.push_str(text);
+    (start, text.len() as u32)
+}
+
+/// Parses one csv cell with the same rules the old row parser used: empty is Empty, a
+/// leading '0' keeps identifier-like values as text, otherwise int, then float, then text.
+fn parse_strict_cell(cell: &str, arena: &mut String) -> ArenaEntry {
+    if cell.is_empty() {
+        return ArenaEntry::Empty
+    }
+    if cell.as_bytes()[0] == 0x30 {
+        let (start, len) = intern(arena, cell);
+        return ArenaEntry::Text(start, len)
+    }
+    if let Ok(value) = cell.parse::<i64>() {
+        return ArenaEntry::Int(value)
+    }
+    if let Ok(value) = cell.parse::<f64>() {
+        return ArenaEntry::Float(value)
+    }
+    let (start, len) = intern(arena, cell);
+    ArenaEntry::Text(start, len)
+}
+
 #[derive(PartialEq, Clone, Debug)]
 pub struct StrictTable {
     pub metadata: Metadata,
     pub name: String,
     pub header: Vec<DbEntry>,
-    pub table: BTreeMap<String, Vec<DbEntry>>,
+    /// Every text byte of every cell, back to back in insertion order. One allocation
+    /// for the whole table instead of an owned String per text cell.
+    text_arena: String,
+    /// All cells, rows back to back with a fixed stride of header.len(), so a row is a
+    /// contiguous slice and a load fills one growing buffer instead of a Vec per row.
+    cells: Vec<ArenaEntry>,
+    /// (primary key span into the arena, row number), sorted by the key bytes. Answers
+    /// the lookups and ranges the BTreeMap used to, without an owned String key per row.
+    index: Vec<((u32, u32), u32)>,
 }
 
 impl StrictTable {
+
+    /// Number of cells per row.
+    fn stride(&self) -> usize {
+        self.header.len()
+    }
+
+    fn arena_str(&self, span: (u32, u32)) -> &str {
+        &self.text_arena[span.0 as usize..(span.0 + span.1) as usize]
+    }
+
+    fn row_cells(&self, row: u32) -> &[ArenaEntry] {
+        let stride = self.stride();
+        &self.cells[row as usize * stride..(row as usize + 1) * stride]
+    }
+
+    /// Finds the index slot for a key: Ok(position) when present, Err(insertion point)
+    /// when not, like binary_search.
+    fn find_key(&self, key: &str) -> Result<usize, usize> {
+        self.index.binary_search_by(|&(span, _)| self.arena_str(span).cmp(key))
+    }
+
+    /// Renders one row as a csv line appended to the printer.
+    fn print_row(&self, row: u32, printer: &mut String) {
+        for entry in self.row_cells(row) {
+            match entry {
+                ArenaEntry::Float(value) => push_f64(printer, *value),
+                ArenaEntry::Int(value) => push_i64(printer, *value),
+                ArenaEntry::Text(start, len) => printer.push_str(self.arena_str((*start, *len))),
+                ArenaEntry::Empty => (),
+            }
+            printer.push(';')
+        }
+        printer.pop();
+        printer.push('\n');
+    }
     pub fn from_csv_string(s: &str, name: &str) -> Result<StrictTable, StrictError> {
         if s.len() < 1 {
             return Err(StrictError::Empty)
@@ -162,59 +252,49 @@ impl StrictTable {
             }
         } // Finished checking
         
-        // println!("one run");
-
-        let mut output = BTreeMap::new();
-        let mut rownum: usize = 0;
-        for row in s.lines() {
-            // This if statement is there to skip the header
-            if rownum == 0 {
-                rownum += 1;
-                continue;
-            }
-            let mut temp = Vec::with_capacity(header.len());
+        // All rows go into one flat cell buffer with a fixed stride and one shared text
+        // arena, so a million-row load costs a few large allocations instead of a Vec and
+        // an owned String per row scattered across the heap.
+        let stride = header.len();
+        let row_count = s.lines().count().saturating_sub(1);
+        let mut text_arena = String::with_capacity(s.len());
+        let mut cells: Vec<ArenaEntry> = Vec::with_capacity(row_count * stride);
+        let mut index: Vec<((u32, u32), u32)> = Vec::with_capacity(row_count);
+
+        for row in s.lines().skip(1) {
+            let row_start = cells.len();
             for col in row.split(';') {
-                if col.len() == 0 { 
-                    temp.push(DbEntry::Empty);
-                }
-                if col.as_bytes()[0] == 0x30 {
-                    temp.push(DbEntry::Text(col.to_owned()));
-                    continue;
-                }
-                match col.parse::<i64>() {
-                    Ok(value) => {
-                        temp.push(DbEntry::Int(value));
-                        continue;
-                    },
-                    Err(_) => (),
-                };
-
-                match col.parse::<f64>() {
-                    Ok(value) => {
-                        temp.push(DbEntry::Float(value));
-                        continue;
-                    },
-                    Err(_) => (),
-                };
-
-                temp.push(DbEntry::Text(col.to_owned()));
-                
-                rownum += 1;
+                cells.push(parse_strict_cell(col, &mut text_arena));
             }
-            if temp.len() == 0 { continue }
-            match &temp[0] {
-                DbEntry::Text(value) => output.insert(value.to_owned(), temp),
-                DbEntry::Int(value) => output.insert(value.to_string(), temp),
+            let key_span = match cells[row_start] {
+                ArenaEntry::Text(start, len) => (start, len),
+                ArenaEntry::Int(value) => intern(&mut text_arena, &value.to_string()),
                 _ => panic!("This is not supposed to happen"),
             };
+            index.push((key_span, (row_start / stride) as u32));
         }
 
+        // Sorted by key bytes, the index answers lookups and ranges like the BTreeMap
+        // did. The sort is stable, so keeping the later of two equal keys matches the
+        // old insert-overwrites behaviour.
+        let key = |span: (u32, u32)| &text_arena[span.0 as usize..(span.0 + span.1) as usize];
+        index.sort_by(|a, b| key(a.0).cmp(key(b.0)));
+        index.dedup_by(|later, kept| {
+            if key(later.0) == key(kept.0) {
+                kept.1 = later.1;
+                true
+            } else {
+                false
+            }
+        });
 
         let r = StrictTable {
             metadata: Metadata::new(name),
             header: header,
             name: String::from(name),
-            table: output,
+            text_arena: text_arena,
+            cells: cells,
+            index: index,
         };
 
         Ok(r)
@@ -222,8 +302,7 @@ impl StrictTable {
 
 
     pub fn to_csv_string(&self) -> String {
-        let mut printer = String::from("");
-        let map = &self.table;
+        let mut printer = String::with_capacity(self.cells.len() * 12 + self.text_arena.len());
         let header = &self.header;
 
         for item in header {
@@ -238,22 +317,11 @@ impl StrictTable {
         printer.pop().unwrap(); // safe since we know there is always a ; character there to be popped
         printer.push('\n');
 
-        for (_, line) in map.iter() {
-            for item in line {
-                match item {
-                    DbEntry::Float(value) => printer.push_str(&value.to_string()),
-                    DbEntry::Int(value) => printer.push_str(&value.to_string()),
-                    DbEntry::Text(value) => printer.push_str(value),
-                    DbEntry::Empty => (),
-                }
-                printer.push(';')
-            }
-            printer.pop().unwrap();  // safe since we know there is always a ; character there to be popped
-            printer.push('\n');
+        for &(_, row) in &self.index {
+            self.print_row(row, &mut printer);
         }
 
         printer.pop();
-        printer = printer.to_owned();
         printer
     }
 
@@ -266,34 +334,55 @@ impl StrictTable {
             {return Err(StrictError::Update("Headers don't match".to_owned()));}
         }
 
-        for (key, value) in mapped_csv.table {
-            self.table.insert(key, value);
+        let stride = self.header.len();
+        for &(key_span, row) in &mapped_csv.index {
+            // The delta's text spans point into its own arena, so text cells are
+            // re-interned into ours as they come over.
+            let mut incoming: Vec<ArenaEntry> = Vec::with_capacity(stride);
+            for entry in mapped_csv.row_cells(row) {
+                incoming.push(match entry {
+                    ArenaEntry::Text(start, len) => {
+                        let (new_start, new_len) = intern(&mut self.text_arena, mapped_csv.arena_str((*start, *len)));
+                        ArenaEntry::Text(new_start, new_len)
+                    },
+                    other => *other,
+                });
+            }
+            let key = mapped_csv.arena_str(key_span);
+            match self.find_key(key) {
+                // Overwriting in place strands the old row's text bytes in the arena.
+                // For the ingest workloads this table serves that beats compacting, and
+                // a save/load round trip drops them.
+                Ok(position) => {
+                    let target = self.index[position].1 as usize * stride;
+                    self.cells[target..target + stride].copy_from_slice(&incoming);
+                },
+                Err(position) => {
+                    let new_row = (self.cells.len() / stride) as u32;
+                    let new_span = match incoming[0] {
+                        ArenaEntry::Text(start, len) => (start, len),
+                        _ => intern(&mut self.text_arena, key),
+                    };
+                    self.cells.extend_from_slice(&incoming);
+                    self.index.insert(position, (new_span, new_row));
+                },
+            }
         }
 
         self.metadata.last_access = get_current_time();
         self.metadata.times_accessed += 1;
+        self.metadata.times_modified += 1;
 
         Ok(())
     }
 
     pub fn query_range(&self, range: (&str, &str)) -> Result<String, StrictError> {
-        let min = range.0.to_owned();
-        let max = range.1.to_owned();
-        let output = self.table.range(min..=max);
-        
+        let first = self.index.partition_point(|&(span, _)| self.arena_str(span) < range.0);
+        let last = self.index.partition_point(|&(span, _)| self.arena_str(span) <= range.1);
+
         let mut printer = String::new();
-        for (_, line) in output {
-            for item in line {
-                match item {
-                    DbEntry::Float(value) => printer.push_str(&value.to_string()),
-                    DbEntry::Int(value) => printer.push_str(&value.to_string()),
-                    DbEntry::Text(value) => printer.push_str(value),
-                    DbEntry::Empty => (),
-                }
-                printer.push(';')
-            }
-            printer.pop().unwrap();  // safe since we know there is always a ; character there to be popped
-            printer.push('\n');
+        for &(_, row) in &self.index[first..last] {
+            self.print_row(row, &mut printer);
         }
         printer.pop();
 
@@ -304,18 +393,10 @@ impl StrictTable {
         let mut printer = String::new();
 
         for item in key_list {
-            for entry in &self.table[item] {
-                match entry {
-                    DbEntry::Float(value) => printer.push_str(&value.to_string()),
-                    DbEntry::Int(value) => printer.push_str(&value.to_string()),
-                    DbEntry::Text(value) => printer.push_str(value),
-                    DbEntry::Empty => (),
-                }
-                printer.push(';')
+            match self.find_key(item) {
+                Ok(position) => self.print_row(self.index[position].1, &mut printer),
+                Err(_) => return Err(StrictError::Query(format!("There is no row with key '{}'", item))),
             }
-            printer.pop().unwrap(); // safe since we know there is always a ; character there to be popped
-            printer.push('\n');
-
         }
         printer.pop();
 
@@ -344,35 +425,6 @@ impl StrictTable {
         table_file.write_all(table.as_bytes());
         meta_file.write_all(metadata.as_bytes());
 
-        // pub struct Metadata {
-        //     pub last_access: u64,
-        //     pub times_accessed: u64,
-        //     pub created_by: String,
-        //     pub accessed_by: HashMap<String, Actions>,
-        // }
-        
-        // pub struct Actions {
-        //     pub uploaded: bool,
-        //     pub downloaded: u64,
-        //     pub updated: u64,
-        //     pub queried: u64,
-        // }
-        
-        // pub enum DbEntry {
-        //     Int(i64),
-        //     Float(f64),
-        //     Text(String),
-        //     Empty,
-        // }
-        
-        // pub struct StrictTable {
-        //     pub metadata: Metadata,
-        //     pub name: String,
-        //     pub header: Vec<DbEntry>,
-        //     pub table: BTreeMap<String, Vec<DbEntry>>,
-        // }
-
-
         Ok(())
     }
 
@@ -406,6 +458,64 @@ pub enum DbVec {
     Ints{ name: KeyString, col: Vec<i64> },
     Floats{ name: KeyString, col: Vec<f64> },
     Texts{ name: KeyString, col: Vec<KeyString> },
+    /// A dictionary encoded text column: the distinct values once each in `dict`, and one
+    /// u32 code per row in `codes`. The dictionary is kept sorted and deduplicated, so
+    /// codes compare like the strings they stand for and sorting, merging and equality
+    /// lookups run on dense integers. Chosen automatically at load time for non primary
+    /// key text columns with at most DICT_MAX_CARDINALITY distinct values.
+    DictTexts{ name: KeyString, dict: Vec<KeyString>, codes: Vec<u32> },
+}
+
+/// The most distinct values a text column may hold and still be dictionary encoded.
+/// Category-like columns sit far below this; columns that pass it stay plain Texts.
+pub const DICT_MAX_CARDINALITY: usize = 255;
+
+/// Builds the sorted deduplicated dictionary over a text column, or None if the column
+/// holds too many distinct values to be worth encoding.
+fn build_dict(col: &[KeyString]) -> Option<Vec<KeyString>> {
+    let mut dict: Vec<KeyString> = Vec::new();
+    for text in col {
+        if let Err(pos) = dict.binary_search(text) {
+            if dict.len() >= DICT_MAX_CARDINALITY {
+                return None
+            }
+            dict.insert(pos, text.clone());
+        }
+    }
+    Some(dict)
+}
+
+/// Encodes a text column against a dictionary that is known to contain every value in it.
+fn encode_with_dict(col: &[KeyString], dict: &[KeyString]) -> Vec<u32> {
+    col.iter().map(|text| dict.binary_search(text).expect("the dictionary was built over this column") as u32).collect()
+}
+
+/// Expands a dictionary encoded column back to one KeyString per row.
+fn decode_dict_column(dict: &[KeyString], codes: &[u32]) -> Vec<KeyString> {
+    codes.iter().map(|&code| dict[code as usize].clone()).collect()
+}
+
+/// Extends a sorted dictionary with the distinct values of `more`, or None if the union
+/// would pass DICT_MAX_CARDINALITY.
+fn union_dict(dict: &[KeyString], more: &[KeyString]) -> Option<Vec<KeyString>> {
+    let mut union = dict.to_vec();
+    for text in more {
+        if let Err(pos) = union.binary_search(text) {
+            if union.len() >= DICT_MAX_CARDINALITY {
+                return None
+            }
+            union.insert(pos, text.clone());
+        }
+    }
+    Some(union)
+}
+
+/// Rewrites codes issued against old_dict to the equivalent codes in new_dict, which must
+/// contain every entry of old_dict. A small lookup table per distinct value, then one
+/// table lookup per row.
+fn remap_codes(codes: &[u32], old_dict: &[KeyString], new_dict: &[KeyString]) -> Vec<u32> {
+    let map: Vec<u32> = old_dict.iter().map(|text| new_dict.binary_search(text).expect("the new dictionary contains every old entry") as u32).collect();
+    codes.iter().map(|&code| map[code as usize]).collect()
 }
 
 #[derive(Clone, Debug, PartialEq, Eq, PartialOrd, Ord)]
@@ -425,53 +535,320 @@ impl HeaderItem {
     }
 }
 
+/// Parses a header line on the form "name,type;name,type-p;..." into a list of HeaderItems.
+/// Shared between the csv parser and the binary table parser.
+pub fn parse_header_line(line: &str) -> Result<Vec<HeaderItem>, StrictError> {
+
+    let mut header = Vec::new();
+    let mut primary_key_set = false;
+
+    for item in line.split(';') {
+        let temp: Vec<&str> = item.split(',').collect();
+        let mut header_item = HeaderItem::new();
+        if temp.is_empty() {
+            return Err(StrictError::MissingType)
+        } else if temp.len() == 1{
+            header_item.kind = DbType::Text;
+        } else if temp.len() > 2 {
+            return Err(StrictError::TooManyHeaderFields)
+        } else {
+            header_item.name = KeyString::from(temp[0].trim());
+            let t = temp[1].trim();
+            match t {
+                "I" | "Int" | "int" | "i" => header_item.kind = DbType::Int,
+                "F" | "Float" | "float" | "f" => header_item.kind = DbType::Float,
+                "T" | "Text" | "text" | "t" => header_item.kind = DbType::Text,
+                "I-p" | "Int-p" | "int-p" | "i-p" => {
+                    if primary_key_set {
+                        return Err(StrictError::TooManyPrimaryKeys)
+                    } else {
+                        header_item.kind = DbType::Int;
+                        header_item.primary_key = true;
+                        primary_key_set = true;
+                    }
+                },
+                "T-p" | "Text-p" | "text-p" | "t-p" => {
+                    if primary_key_set {
+                        return Err(StrictError::TooManyPrimaryKeys)
+                    } else {
+                        header_item.kind = DbType::Text;
+                        header_item.primary_key = true;
+                        primary_key_set = true;
+                    }
+                },
+                "F-p" | "Float-p" | "float-p" | "f-p" => return Err(StrictError::FloatPrimaryKey),
+                _ => return Err(StrictError::WrongType),
+            }
+        }
+        header.push(header_item);
+    }
+
+    if !primary_key_set {
+        match header[0].kind {
+            DbType::Int => header[0].primary_key = true,
+            DbType::Text => header[0].primary_key = true,
+            _ => unreachable!("Should already have a primary key or have been rejected for float primary key")
+        };
+    }
+
+    Ok(header)
+}
+
+/// Magic bytes at the start of a binary encoded ColumnTable.
+pub const BIN_TABLE_MAGIC: &[u8; 8] = b"EZDBCOLT";
+
+/// Caps how many rows a claimed-but-unverified row count may preallocate. Binary payloads
+/// come off the wire, so their row count is attacker controlled; columns still grow past
+/// this hint if the payload really delivers that many cells.
+pub const MAX_PREALLOCATED_ROWS: usize = 1_000_000;
+
 #[derive(Clone, Debug)]
 pub struct ColumnTable {
     pub metadata: Metadata,
     pub name: KeyString,
     pub header: Vec<HeaderItem>,
     pub table: Vec<DbVec>,
+    /// Opt-in secondary indexes. Maps an indexed column name to a permutation of the row
+    /// indexes sorted by that column's values, so lookups by a non primary key column can
+    /// binary search instead of scanning. Not serialized, rebuilt on every write.
+    pub secondary_indexes: HashMap<KeyString, Vec<usize>>,
+    /// Reusable scratch space for update() merges. Not serialized.
+    pub merge_scratch: MergeScratch,
+    /// One flag per row; true marks the row as deleted. Tombstoned rows are skipped by
+    /// queries and by the string/binary renderings, and are physically removed by compact()
+    /// once enough of them pile up, so a small delete never rewrites the whole table.
+    pub tombstones: Vec<bool>,
 }
 
-impl Display for ColumnTable {
-    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
-        let mut printer = String::new();
+/// How large a fraction of a table's rows may be tombstones before the save loop compacts it.
+pub const TOMBSTONE_COMPACT_RATIO: f64 = 0.1;
+
+/// Rows below which the per-column stages of load, sort and update stay on one thread.
+/// The columns are independent once the primary key permutation or merge plan exists, but
+/// spawning a scoped thread per column only pays for itself on bulk work.
+pub const PARALLEL_ROW_THRESHOLD: usize = 65_536;
+
+/// Scratch buffers for merging a delta into a table. Kept on the ColumnTable so applying a
+/// small delta to a large table every few seconds reuses the same allocations instead of
+/// allocating and freeing a combined-length vector per column per update.
+#[derive(Clone, Debug, Default)]
+pub struct MergeScratch {
+    ints: Vec<i64>,
+    floats: Vec<f64>,
+    texts: Vec<KeyString>,
+    codes: Vec<u32>,
+    bools: Vec<bool>,
+    record: Vec<u8>,
+}
 
-        for item in &self.header {
-            printer.push_str(&item.name);
-            printer.push(',');
-            match item.kind {
-                DbType::Float => printer.push('f'),
-                DbType::Int => printer.push('i'),
-                DbType::Text => printer.push('t'),
+/// Assembles and validates a table parsed from the binary format. Shared by from_binary
+/// and the streaming parser: sorting and the primary key check have to happen either way,
+/// since the binary may come from an untrusted uploader.
+fn finalize_binary_table(header: Vec<HeaderItem>, table: Vec<DbVec>, table_name: &str, created_by: &str) -> Result<ColumnTable, StrictError> {
+    let mut output = ColumnTable {
+        metadata: Metadata::new(created_by),
+        name: KeyString::from(table_name),
+        header: header,
+        table: table,
+        secondary_indexes: HashMap::new(),
+        merge_scratch: MergeScratch::default(),
+        tombstones: Vec::new(),
+    };
+    output.tombstones = vec![false; output.len()];
+    output.sort();
+
+    match &output.table[output.get_primary_key_col_index()] {
+        DbVec::Ints { name: _, col } => {
+            let mut i = 1;
+            while i < col.len() {
+                if col[i] == col[i-1] {
+                    return Err(StrictError::NonUniquePrimaryKey(i))
+                }
+                i += 1;
             }
-            if item.primary_key {
-                printer.push_str("-p");
+        },
+        DbVec::Texts { name: _, col } => {
+            let mut i = 1;
+            while i < col.len() {
+                if col[i] == col[i-1] {
+                    return Err(StrictError::NonUniquePrimaryKey(i))
+                }
+                i += 1;
             }
-            printer.push(';');
+        },
+        DbVec::Floats { name: _, col: _ } => unreachable!("Should never have a float primary key"),
+        DbVec::DictTexts { name: _, dict: _, codes: _ } => unreachable!("Primary key columns are never dictionary encoded"),
+    }
+
+    output.dict_encode_text_columns();
+
+    Ok(output)
+}
+
+/// Incremental parser for the binary columnar format written by to_binary(). Bytes are fed
+/// in whatever sized chunks the wire delivers and cells are parsed into their typed column
+/// as soon as they are complete, so the raw payload never has to sit in memory alongside
+/// the parsed table. Only the bytes of one partial cell and whatever the last chunk left
+/// over stay buffered.
+pub struct StreamingBinaryParser {
+    buffer: Vec<u8>,
+    header: Vec<HeaderItem>,
+    rows: usize,
+    columns: Vec<DbVec>,
+    building: Option<DbVec>,
+    parsing_header: bool,
+}
+
+impl StreamingBinaryParser {
+
+    pub fn new() -> StreamingBinaryParser {
+        StreamingBinaryParser {
+            buffer: Vec::new(),
+            header: Vec::new(),
+            rows: 0,
+            columns: Vec::new(),
+            building: None,
+            parsing_header: true,
         }
-        printer.pop();
+    }
+
+    fn column_len(column: &DbVec) -> usize {
+        match column {
+            DbVec::Ints { name: _, col } => col.len(),
+            DbVec::Floats { name: _, col } => col.len(),
+            DbVec::Texts { name: _, col } => col.len(),
+            DbVec::DictTexts { name: _, dict: _, codes } => codes.len(),
+        }
+    }
+
+    /// Feeds the next chunk of the payload. Every column that completes is handed to
+    /// on_column before the call returns, so a pipeline can start transforming early
+    /// columns while the rest of the table is still on the wire.
+    pub fn feed(&mut self, chunk: &[u8], mut on_column: impl FnMut(&DbVec)) -> Result<(), StrictError> {
+        self.buffer.extend_from_slice(chunk);
+        let mut pos: usize = 0;
+
+        if self.parsing_header {
+            if self.buffer.len() < 16 {
+                return Ok(())
+            }
+            if &self.buffer[0..8] != BIN_TABLE_MAGIC {
+                return Err(StrictError::BinaryFormat(0))
+            }
+            let header_len = u64::from_le_bytes(self.buffer[8..16].try_into().expect("8 byte slice always converts")) as usize;
+            if self.buffer.len() < 24 + header_len {
+                return Ok(())
+            }
+            let header_str = match str::from_utf8(&self.buffer[16..16+header_len]) {
+                Ok(s) => s,
+                Err(_) => return Err(StrictError::BinaryFormat(16)),
+            };
+            self.header = parse_header_line(header_str)?;
+            self.rows = u64::from_le_bytes(self.buffer[16+header_len..24+header_len].try_into().expect("8 byte slice always converts")) as usize;
+            self.parsing_header = false;
+            pos = 24 + header_len;
+        }
+
+        // Parse as many cells as the buffered bytes cover, completing columns along the way.
+        while self.columns.len() < self.header.len() {
+            let item = &self.header[self.columns.len()];
+            // The total payload length is unknown while streaming, so the claimed row
+            // count only sizes a capped hint; the columns grow with the actual cells.
+            let capacity = self.rows.min(MAX_PREALLOCATED_ROWS);
+            let column = self.building.get_or_insert_with(|| match item.kind {
+                DbType::Int => DbVec::Ints { name: item.name.clone(), col: Vec::with_capacity(capacity) },
+                DbType::Float => DbVec::Floats { name: item.name.clone(), col: Vec::with_capacity(capacity) },
+                DbType::Text => DbVec::Texts { name: item.name.clone(), col: Vec::with_capacity(capacity) },
+            });
+
+            match column {
+                DbVec::Ints { name: _, col } => {
+                    while col.len() < self.rows && pos + 8 <= self.buffer.len() {
+                        col.push(i64::from_le_bytes(self.buffer[pos..pos+8].try_into().expect("8 byte slice always converts")));
+                        pos += 8;
+                    }
+                },
+                DbVec::Floats { name: _, col } => {
+                    while col.len() < self.rows && pos + 8 <= self.buffer.len() {
+                        col.push(f64::from_le_bytes(self.buffer[pos..pos+8].try_into().expect("8 byte slice always converts")));
+                        pos += 8;
+                    }
+                },
+                DbVec::Texts { name: _, col } => {
+                    while col.len() < self.rows && pos + 4 <= self.buffer.len() {
+                        let text_len = u32::from_le_bytes(self.buffer[pos..pos+4].try_into().expect("4 byte slice always converts")) as usize;
+                        if pos + 4 + text_len > self.buffer.len() {
+                            // The cell is split across chunks; its length prefix stays
+                            // unconsumed until the rest arrives.
+                            break
+                        }
+                        let text = match str::from_utf8(&self.buffer[pos+4..pos+4+text_len]) {
+                            Ok(s) => s,
+                            Err(_) => return Err(StrictError::BinaryFormat(pos)),
+                        };
+                        col.push(KeyString::from(text));
+                        pos += 4 + text_len;
+                    }
+                },
+                DbVec::DictTexts { name: _, dict: _, codes: _ } => unreachable!("The parser only builds plain columns; encoding happens in finalize_binary_table"),
+            }
+
+            if Self::column_len(column) == self.rows {
+                let finished = self.building.take().expect("building column was just filled");
+                self.columns.push(finished);
+                on_column(&self.columns[self.columns.len()-1]);
+            } else {
+                break
+            }
+        }
+
+        self.buffer.drain(0..pos);
+        Ok(())
+    }
+
+    /// Consumes the parser and hands back the finished table, validated the same way
+    /// from_binary validates one. Fails if the payload ended mid-column.
+    pub fn finish(self, table_name: &str, created_by: &str) -> Result<ColumnTable, StrictError> {
+        if self.parsing_header || self.columns.len() != self.header.len() {
+            return Err(StrictError::BinaryFormat(0))
+        }
+        finalize_binary_table(self.header, self.columns, table_name, created_by)
+    }
+}
+
+impl Display for ColumnTable {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        let header = self.header_string();
+        // One allocation up front instead of growing through a million small reallocations.
+        // ~12 bytes per cell is a guess, but a cheap one: too low just means a few doublings.
+        let mut printer = String::with_capacity(header.len() + self.len() * (self.table.len() * 12 + 1));
+        printer.push_str(&header);
         printer.push('\n');
 
         for i in 0..(self.len()) {
 
+            if self.tombstones[i] {
+                continue
+            }
+
             for vec in &self.table {
                 match vec {
                     DbVec::Floats { name: _, col } => {
-                        // println!("float: col.len(): {}", col.len());
-                        printer.push_str(&col[i].to_string());
+                        push_f64(&mut printer, col[i]);
                         printer.push(';');
                     },
                     DbVec::Ints { name: _, col } => {
-                        // println!("int: col.len(): {}", col.len());
-                        printer.push_str(&col[i].to_string());
+                        push_i64(&mut printer, col[i]);
                         printer.push(';');
                     },
                     DbVec::Texts { name: _, col } => {
-                        // println!("text: col.len(): {}", col.len());
                         printer.push_str(&col[i]);
                         printer.push(';');
                     },
+                    DbVec::DictTexts { name: _, dict, codes } => {
+                        printer.push_str(&dict[codes[i] as usize]);
+                        printer.push(';');
+                    },
                 }
             }
             printer.pop();
@@ -490,125 +867,69 @@ impl ColumnTable {
             return Err(StrictError::Empty)
         }
 
-        let mut header = Vec::new();
-        let mut primary_key_set = false;
-
-        let first_line: Vec<&str> = s.split('\n').next().expect("confirmed to exist because of earlier check").split(';').collect();
-        for item in first_line {
-            let temp: Vec<&str> = item.split(',').collect();
-            let mut header_item = HeaderItem::new();
-            if temp.is_empty() {
-                return Err(StrictError::MissingType)
-            } else if temp.len() == 1{
-                header_item.kind = DbType::Text;
-            } else if temp.len() > 2 {
-                return Err(StrictError::TooManyHeaderFields)
-            } else {
-                header_item.name = KeyString::from(temp[0].trim());
-                let t = temp[1].trim();
-                match t {
-                    "I" | "Int" | "int" | "i" => header_item.kind = DbType::Int,
-                    "F" | "Float" | "float" | "f" => header_item.kind = DbType::Float,
-                    "T" | "Text" | "text" | "t" => header_item.kind = DbType::Text,
-                    "I-p" | "Int-p" | "int-p" | "i-p" => {
-                        if primary_key_set {
-                            return Err(StrictError::TooManyPrimaryKeys)
-                        } else {
-                            header_item.kind = DbType::Int;
-                            header_item.primary_key = true;
-                            primary_key_set = true;
-                        }
-                    },
-                    "T-p" | "Text-p" | "text-p" | "t-p" => {
-                        if primary_key_set {
-                            return Err(StrictError::TooManyPrimaryKeys)
-                        } else {
-                            header_item.kind = DbType::Text;
-                            header_item.primary_key = true;
-                            primary_key_set = true;
-                        }
-                    },
-                    "F-p" | "Float-p" | "float-p" | "f-p" => return Err(StrictError::FloatPrimaryKey),
-                    _ => return Err(StrictError::WrongType),
-                }
-            }
-            header.push(header_item);
-        }
+        // split('\n') keeps a CRLF ending's \r, which str::lines() used to trim.
+        let header_line = s.split('\n').next().expect("confirmed to exist because of earlier check");
+        let header = parse_header_line(header_line.strip_suffix('\r').unwrap_or(header_line))?;
 
-        if !primary_key_set {
-            match header[0].kind {
-                DbType::Int => header[0].primary_key = true,
-                DbType::Text => header[0].primary_key = true,
-                _ => unreachable!("Should already have a primary key or have been rejected for float primary key")
-            };
+        let body = match s.find('\n') {
+            Some(n) => &s.as_bytes()[n+1..],
+            None => &[] as &[u8],
+        };
+
+        // One cheap vectorizable pass to count rows so every column can reserve up front.
+        let mut rows = body.iter().filter(|&&b| b == b'\n').count();
+        if !body.is_empty() && *body.last().expect("checked non-empty") != b'\n' {
+            rows += 1;
         }
 
-        let mut line_index = 0;
-        let mut data: Vec<Vec<&str>> = Vec::new();
-        for line in s.lines() {
-            if line_index == 0 {
-                line_index += 1;
-                continue
+        // Bulk loads split the body at line boundaries into one chunk per core; the chunks
+        // parse independently and the per-chunk columns are stitched back together in
+        // order. Small bodies stay on one thread where the spawn overhead would cost more
+        // than it returns.
+        let mut result: Vec<DbVec>;
+        if rows >= PARALLEL_ROW_THRESHOLD {
+            let threads = std::thread::available_parallelism().map(|n| n.get()).unwrap_or(1);
+            let chunk_goal = body.len() / threads + 1;
+            // Each chunk carries the 1-based line number of its first row, so errors from
+            // a chunk still point at the right line of the original csv.
+            let mut chunks: Vec<(&[u8], usize)> = Vec::with_capacity(threads);
+            let mut start = 0;
+            let mut first_line = 1;
+            while start < body.len() {
+                let mut end = std::cmp::min(start + chunk_goal, body.len());
+                while end < body.len() && body[end] != b'\n' {
+                    end += 1;
+                }
+                if end < body.len() {
+                    end += 1;
+                }
+                let chunk = &body[start..end];
+                chunks.push((chunk, first_line));
+                first_line += chunk.iter().filter(|&&b| b == b'\n').count();
+                start = end;
             }
-            for (row_index,cell) in line.split(';').enumerate() {
-                if line_index == 1 {
-                    data.push(Vec::from([cell]));
-                } else {
-                    data[row_index].push(cell);
+
+            let mut chunk_results: Vec<Result<Vec<DbVec>, StrictError>> = Vec::with_capacity(chunks.len());
+            std::thread::scope(|scope| {
+                let mut handles = Vec::with_capacity(chunks.len());
+                for &(chunk, line) in &chunks {
+                    let header = &header;
+                    handles.push(scope.spawn(move || parse_csv_cells(chunk, header, rows / threads + 1, line)));
                 }
+                for handle in handles {
+                    chunk_results.push(handle.join().expect("the csv parser does not panic"));
+                }
+            });
 
+            let mut chunk_results = chunk_results.into_iter();
+            result = chunk_results.next().expect("there is at least one chunk")?;
+            for chunk_result in chunk_results {
+                for (column, parsed) in result.iter_mut().zip(chunk_result?) {
+                    append_parsed_column(column, parsed);
+                }
             }
-            line_index += 1;
-        }
-
-        let mut result = Vec::new();
-        let mut i = 0;
-        for col in data {
-            
-            let db_vec = match header[i].kind {
-                DbType::Float => {
-                    let mut outvec = Vec::with_capacity(col.len());
-                    let mut index = 0;
-                    for cell in col {
-                        let temp = match cell.parse::<f64>() {
-                            Ok(x) => x,
-                            Err(_) => {
-                                // println!("failed to parse: {}", cell);
-                                return Err(StrictError::Parse(index))
-                            },
-                        };
-                        outvec.push(temp);
-                        index += 1;
-                    }
-                    DbVec::Floats { name: header[i].name.clone(), col: outvec }
-                },
-                DbType::Int => {
-                    let mut outvec = Vec::with_capacity(col.len());
-                    let mut index = 0;
-                    for cell in col {
-                        let temp = match cell.parse::<i64>() {
-                            Ok(x) => x,
-                            Err(_) => {
-                                // println!("failed to parse: {}", cell);
-                                return Err(StrictError::Parse(index))
-                            },
-                        };
-                        outvec.push(temp);
-                        index += 1;
-                    }
-                    DbVec::Ints { name: header[i].name.clone(), col: outvec }
-                },
-                DbType::Text => {
-                    let mut outvec = Vec::with_capacity(col.len());
-                    for cell in col {
-                        outvec.push(KeyString::from(cell));
-                    }
-                    DbVec::Texts { name: header[i].name.clone(), col: outvec }
-                },
-            };
-            
-            result.push(db_vec);
-            i += 1;
+        } else {
+            result = parse_csv_cells(body, &header, rows, 1)?;
         }
 
         let mut primary_key_index = 0;
@@ -637,130 +958,516 @@ impl ColumnTable {
                 }
             },
             DbVec::Floats { name: _, col: _ } => unreachable!("Should never have a float primary key"),
+            DbVec::DictTexts { name: _, dict: _, codes: _ } => unreachable!("Primary key columns are never dictionary encoded"),
         }
 
-        let mut output = ColumnTable { 
-            metadata: Metadata::new(created_by), 
-            name: KeyString::from(table_name), 
-            header: header, 
-            table: result 
+        let mut output = ColumnTable {
+            metadata: Metadata::new(created_by),
+            name: KeyString::from(table_name),
+            header: header,
+            table: result,
+            secondary_indexes: HashMap::new(),
+            merge_scratch: MergeScratch::default(),
+            tombstones: Vec::new(),
         };
+        output.tombstones = vec![false; output.len()];
         output.sort();
+        output.dict_encode_text_columns();
         Ok(
             output
         )
 
     }
 
-    pub fn update_from_csv(&mut self, input_csv: &str) -> Result<(), StrictError> {
-
-        let insert_table = ColumnTable::from_csv_string(input_csv, "insert", "system")?;
-
-        self.update(&insert_table)?;
-
-        Ok(())
+    /// Dictionary encodes every non primary key text column whose cardinality is low
+    /// enough. Category-like columns repeated across millions of rows shrink from one
+    /// KeyString per cell to one u32 per cell, and everything that compares or moves
+    /// cells on them afterwards works on dense integers.
+    fn dict_encode_text_columns(&mut self) {
+        for (item, vec) in self.header.iter().zip(self.table.iter_mut()) {
+            if item.primary_key {
+                // Primary keys are unique, so a dictionary would just be the column again.
+                continue
+            }
+            if let DbVec::Texts { name, col } = vec {
+                if let Some(dict) = build_dict(col) {
+                    let codes = encode_with_dict(col, &dict);
+                    *vec = DbVec::DictTexts { name: name.clone(), dict, codes };
+                }
+            }
+        }
     }
 
-    pub fn get_primary_key_col_index(&self) -> usize {
-        let mut self_primary_key_index = 0;
-        
-        let mut i = 0;
+    /// Renders the header on the same form as the first line of the csv representation.
+    pub fn header_string(&self) -> String {
+        let mut printer = String::new();
+
         for item in &self.header {
+            printer.push_str(&item.name);
+            printer.push(',');
+            match item.kind {
+                DbType::Float => printer.push('f'),
+                DbType::Int => printer.push('i'),
+                DbType::Text => printer.push('t'),
+            }
             if item.primary_key {
-                self_primary_key_index = i;
+                printer.push_str("-p");
             }
-            i+= 1;
+            printer.push(';');
         }
-
-        self_primary_key_index
+        printer.pop();
+        printer
     }
 
-    pub fn update(&mut self, other_table: &ColumnTable) -> Result<(), StrictError> {
+    /// Serializes the table to the binary columnar format. Layout is:
+    /// magic bytes, u64 header length, header string, u64 row count, then the columns
+    /// in header order. Int and Float columns are raw little endian buffers, Text
+    /// columns are u32 length prefixed utf-8. This skips all the int/float to decimal
+    /// text formatting that the csv path pays for on every download.
+    pub fn to_binary(&self) -> Vec<u8> {
 
-        if self.header != other_table.header {
-            return Err(StrictError::Update("Headers don't match".to_owned()));
-        }
+        // Tombstoned rows are dead and must not travel, so the row count and the column
+        // dumps below only cover the live rows.
+        let live = self.len() - self.tombstone_count();
 
-        let self_primary_key_index = self.get_primary_key_col_index();
+        // Rough capacity guess: 8 bytes per numeric cell, 16 per text cell.
+        let mut output: Vec<u8> = Vec::with_capacity(32 + self.table.len() * live * 16);
+        output.extend_from_slice(BIN_TABLE_MAGIC);
 
-        let minlen = std::cmp::min(self.table.len(), other_table.table.len());
+        let header_string = self.header_string();
+        output.extend_from_slice(&(header_string.len() as u64).to_le_bytes());
+        output.extend_from_slice(header_string.as_bytes());
+        output.extend_from_slice(&(live as u64).to_le_bytes());
 
-        let record_vec: Vec<u8>;
-        match &mut self.table[self_primary_key_index] {
-            DbVec::Ints { name: _, col } => {
-                match &other_table.table[self_primary_key_index] {
-                    DbVec::Ints { name: _, col: other_col } => {
-                        (*col, record_vec) = merge_sorted(col, other_col);
-                    },
-                    _ => unreachable!("Should always have the same primary key column")
-                }
-            },
-            DbVec::Texts { name: _, col } => {
-                match &other_table.table[self_primary_key_index] {
-                    DbVec::Texts { name: _, col: other_col } => {
-                        (*col, record_vec) = merge_sorted(col, other_col);
-                    },
-                    _ => unreachable!("Should always have the same primary key column")
-                }
-            },
-            DbVec::Floats { name: _, col: _ } => unreachable!("Should never have a float primary key column"),
+        for vec in &self.table {
+            match vec {
+                DbVec::Ints { name: _, col } => {
+                    for (num, dead) in col.iter().zip(&self.tombstones) {
+                        if !dead {
+                            output.extend_from_slice(&num.to_le_bytes());
+                        }
+                    }
+                },
+                DbVec::Floats { name: _, col } => {
+                    for (num, dead) in col.iter().zip(&self.tombstones) {
+                        if !dead {
+                            output.extend_from_slice(&num.to_le_bytes());
+                        }
+                    }
+                },
+                DbVec::Texts { name: _, col } => {
+                    for (text, dead) in col.iter().zip(&self.tombstones) {
+                        if !dead {
+                            output.extend_from_slice(&(text.len() as u32).to_le_bytes());
+                            output.extend_from_slice(text.as_bytes());
+                        }
+                    }
+                },
+                // Dictionary columns travel as plain text cells, so the wire format stays
+                // the same and the receiver re-encodes on load if the cardinality warrants.
+                DbVec::DictTexts { name: _, dict, codes } => {
+                    for (&code, dead) in codes.iter().zip(&self.tombstones) {
+                        if !dead {
+                            let text = &dict[code as usize];
+                            output.extend_from_slice(&(text.len() as u32).to_le_bytes());
+                            output.extend_from_slice(text.as_bytes());
+                        }
+                    }
+                },
+            }
         }
-        for i in 0..minlen {
 
-            if i == self_primary_key_index {
-                continue;
-            }
+        output
+    }
 
-            match &mut self.table[i] {
-                DbVec::Ints { name: _, col } => {
-                    match &other_table.table[i] {
-                        DbVec::Ints { name: _, col: other_col } => {
-                            *col = merge_in_order(col, other_col, &record_vec);
-                        },
-                        _ => unreachable!("Should always have the same type column")
+    /// Parses a table from the binary columnar format written by to_binary().
+    pub fn from_binary(bin: &[u8], table_name: &str, created_by: &str) -> Result<ColumnTable, StrictError> {
+
+        if bin.len() < BIN_TABLE_MAGIC.len() + 16 || &bin[0..8] != BIN_TABLE_MAGIC {
+            return Err(StrictError::BinaryFormat(0))
+        }
+
+        let mut pos: usize = 8;
+        let header_len = u64::from_le_bytes(bin[pos..pos+8].try_into().expect("8 byte slice always converts")) as usize;
+        pos += 8;
+        // header_len is untrusted too: cap it before the addition below can wrap.
+        if header_len > bin.len() || pos + header_len + 8 > bin.len() {
+            return Err(StrictError::BinaryFormat(pos))
+        }
+        let header_str = match str::from_utf8(&bin[pos..pos+header_len]) {
+            Ok(s) => s,
+            Err(_) => return Err(StrictError::BinaryFormat(pos)),
+        };
+        let header = parse_header_line(header_str)?;
+        pos += header_len;
+
+        let rows = u64::from_le_bytes(bin[pos..pos+8].try_into().expect("8 byte slice always converts")) as usize;
+        pos += 8;
+
+        // The row count is untrusted: unchecked it can wrap the pos + rows*8 bounds checks
+        // below in release builds or abort the allocator through with_capacity. Every row
+        // costs at least one byte per column in this format, so a count beyond the payload
+        // length is malformed.
+        if rows > bin.len() || rows.checked_mul(8).is_none() {
+            return Err(StrictError::BinaryFormat(pos))
+        }
+
+        let mut result = Vec::with_capacity(header.len());
+        for item in &header {
+            match item.kind {
+                DbType::Int => {
+                    if pos + rows*8 > bin.len() {
+                        return Err(StrictError::BinaryFormat(pos))
                     }
+                    let mut outvec = Vec::with_capacity(rows);
+                    for chunk in bin[pos..pos + rows*8].chunks_exact(8) {
+                        outvec.push(i64::from_le_bytes(chunk.try_into().expect("8 byte chunk always converts")));
+                    }
+                    pos += rows*8;
+                    result.push(DbVec::Ints { name: item.name.clone(), col: outvec });
                 },
-                DbVec::Texts { name: _, col } => {
-                    match &other_table.table[i] {
-                        DbVec::Texts { name: _, col: other_col } => {
-                            *col = merge_in_order(col, other_col, &record_vec);
-                        },
-                        _ => unreachable!("Should always have the same type column")
+                DbType::Float => {
+                    if pos + rows*8 > bin.len() {
+                        return Err(StrictError::BinaryFormat(pos))
+                    }
+                    let mut outvec = Vec::with_capacity(rows);
+                    for chunk in bin[pos..pos + rows*8].chunks_exact(8) {
+                        outvec.push(f64::from_le_bytes(chunk.try_into().expect("8 byte chunk always converts")));
                     }
+                    pos += rows*8;
+                    result.push(DbVec::Floats { name: item.name.clone(), col: outvec });
                 },
-                DbVec::Floats { name: _, col } => {
-                    match &other_table.table[i] {
-                        DbVec::Floats { name: _, col: other_col } => {
-                            *col = merge_in_order(col, other_col, &record_vec);
-                        },
-                        _ => unreachable!("Should always have the same type column")
+                DbType::Text => {
+                    let mut outvec = Vec::with_capacity(rows);
+                    for _ in 0..rows {
+                        if pos + 4 > bin.len() {
+                            return Err(StrictError::BinaryFormat(pos))
+                        }
+                        let text_len = u32::from_le_bytes(bin[pos..pos+4].try_into().expect("4 byte slice always converts")) as usize;
+                        pos += 4;
+                        if pos + text_len > bin.len() {
+                            return Err(StrictError::BinaryFormat(pos))
+                        }
+                        let text = match str::from_utf8(&bin[pos..pos+text_len]) {
+                            Ok(s) => s,
+                            Err(_) => return Err(StrictError::BinaryFormat(pos)),
+                        };
+                        outvec.push(KeyString::from(text));
+                        pos += text_len;
                     }
+                    result.push(DbVec::Texts { name: item.name.clone(), col: outvec });
                 },
             }
+        }
+
+        finalize_binary_table(header, result, table_name, created_by)
+    }
 
+    pub fn update_from_csv(&mut self, input_csv: &str) -> Result<(), StrictError> {
+
+        let insert_table = ColumnTable::from_csv_string(input_csv, "insert", "system")?;
+
+        self.update(&insert_table)?;
 
+        Ok(())
+    }
 
+    pub fn get_primary_key_col_index(&self) -> usize {
+        let mut self_primary_key_index = 0;
+        
+        let mut i = 0;
+        for item in &self.header {
+            if item.primary_key {
+                self_primary_key_index = i;
+            }
+            i+= 1;
         }
 
+        self_primary_key_index
+    }
+
+    pub fn update(&mut self, other_table: &ColumnTable) -> Result<(), StrictError> {
+
+        if self.header != other_table.header {
+            return Err(StrictError::Update("Headers don't match".to_owned()));
+        }
+
+        if other_table.len() == 0 {
+            return Ok(())
+        }
+
+        let self_primary_key_index = self.get_primary_key_col_index();
+
+        let minlen = std::cmp::min(self.table.len(), other_table.table.len());
+
+        // Text columns may be dictionary encoded on either side, and two independently
+        // built dictionaries rarely match. Each pair is first brought onto a shared
+        // representation - both over the union dictionary when it fits, both plain
+        // otherwise - so the merge loops below only ever see matching variants and the
+        // dictionary cases merge on raw u32 codes. Numeric columns come back untouched.
+        let mut other_converted: Vec<Option<DbVec>> = Vec::with_capacity(minlen);
+        for i in 0..minlen {
+            other_converted.push(self.normalize_for_merge(i, &other_table.table[i]));
+        }
+
+        // Fast path: a delta whose smallest key is above our largest key is a plain append.
+        // Ingest batches are usually new rows at the end, so nothing gets rewritten at all.
+        let append_only = match (&self.table[self_primary_key_index], &other_table.table[self_primary_key_index]) {
+            (DbVec::Ints { name: _, col }, DbVec::Ints { name: _, col: other_col }) => {
+                match col.last() {
+                    Some(last) => last < &other_col[0],
+                    None => true,
+                }
+            },
+            (DbVec::Texts { name: _, col }, DbVec::Texts { name: _, col: other_col }) => {
+                match col.last() {
+                    Some(last) => last < &other_col[0],
+                    None => true,
+                }
+            },
+            _ => unreachable!("Should always have the same primary key column"),
+        };
+
+        if append_only {
+            for i in 0..minlen {
+                let other_column = match &other_converted[i] {
+                    Some(converted) => converted,
+                    None => &other_table.table[i],
+                };
+                match &mut self.table[i] {
+                    DbVec::Ints { name: _, col } => {
+                        match other_column {
+                            DbVec::Ints { name: _, col: other_col } => col.extend_from_slice(other_col),
+                            _ => unreachable!("Should always have the same type column")
+                        }
+                    },
+                    DbVec::Texts { name: _, col } => {
+                        match other_column {
+                            DbVec::Texts { name: _, col: other_col } => col.extend_from_slice(other_col),
+                            _ => unreachable!("Should always have the same type column")
+                        }
+                    },
+                    DbVec::Floats { name: _, col } => {
+                        match other_column {
+                            DbVec::Floats { name: _, col: other_col } => col.extend_from_slice(other_col),
+                            _ => unreachable!("Should always have the same type column")
+                        }
+                    },
+                    DbVec::DictTexts { name: _, dict: _, codes } => {
+                        match other_column {
+                            // The dictionaries are identical after normalization, so the
+                            // codes append as-is.
+                            DbVec::DictTexts { name: _, dict: _, codes: other_codes } => codes.extend_from_slice(other_codes),
+                            _ => unreachable!("Should always have the same type column")
+                        }
+                    },
+                }
+            }
+
+            self.tombstones.extend_from_slice(&other_table.tombstones);
+
+            self.rebuild_secondary_indexes();
+
+            self.metadata.times_modified += 1;
+
+            return Ok(())
+        }
+
+        // The merge plan is built from one pass over the primary key column, then replayed
+        // over every column. The scratch buffers live on the table so a periodic delta to a
+        // large table reuses the same allocations update after update.
+        let MergeScratch { ints: scratch_ints, floats: scratch_floats, texts: scratch_texts, codes: scratch_codes, bools: scratch_bools, record } = &mut self.merge_scratch;
+        record.clear();
+        match (&self.table[self_primary_key_index], &other_table.table[self_primary_key_index]) {
+            (DbVec::Ints { name: _, col }, DbVec::Ints { name: _, col: other_col }) => merge_plan(col, other_col, record),
+            (DbVec::Texts { name: _, col }, DbVec::Texts { name: _, col: other_col }) => merge_plan(col, other_col, record),
+            _ => unreachable!("Should always have the same primary key column"),
+        }
+
+        if record.len() >= PARALLEL_ROW_THRESHOLD && minlen > 1 {
+            // The column merges are independent once the plan exists, so they fan out one
+            // scoped thread per column. The shared scratch buffers cannot cross threads,
+            // so each column allocates its own; at the sizes where this path runs that is
+            // noise next to the merging itself.
+            let record_ref: &[u8] = record;
+            let other_converted_ref = &other_converted;
+            std::thread::scope(|scope| {
+                for (i, column) in self.table.iter_mut().take(minlen).enumerate() {
+                    let other_column = match &other_converted_ref[i] {
+                        Some(converted) => converted,
+                        None => &other_table.table[i],
+                    };
+                    scope.spawn(move || merge_column_with_plan(column, other_column, record_ref));
+                }
+            });
+        } else {
+            for i in 0..minlen {
+                let other_column = match &other_converted[i] {
+                    Some(converted) => converted,
+                    None => &other_table.table[i],
+                };
+                match &mut self.table[i] {
+                    DbVec::Ints { name: _, col } => {
+                        match other_column {
+                            DbVec::Ints { name: _, col: other_col } => {
+                                merge_with_plan(col, other_col, record, scratch_ints);
+                            },
+                            _ => unreachable!("Should always have the same type column")
+                        }
+                    },
+                    DbVec::Texts { name: _, col } => {
+                        match other_column {
+                            DbVec::Texts { name: _, col: other_col } => {
+                                merge_with_plan(col, other_col, record, scratch_texts);
+                            },
+                            _ => unreachable!("Should always have the same type column")
+                        }
+                    },
+                    DbVec::Floats { name: _, col } => {
+                        match other_column {
+                            DbVec::Floats { name: _, col: other_col } => {
+                                merge_with_plan(col, other_col, record, scratch_floats);
+                            },
+                            _ => unreachable!("Should always have the same type column")
+                        }
+                    },
+                    DbVec::DictTexts { name: _, dict: _, codes } => {
+                        match other_column {
+                            DbVec::DictTexts { name: _, dict: _, codes: other_codes } => {
+                                merge_with_plan(codes, other_codes, record, scratch_codes);
+                            },
+                            _ => unreachable!("Should always have the same type column")
+                        }
+                    },
+                }
+            }
+        }
+
+        // The tombstone flags follow the same plan; a delta row that overwrites a
+        // tombstoned key brings the delta's flag, which resurrects the row.
+        merge_with_plan(&mut self.tombstones, &other_table.tombstones, record, scratch_bools);
+
+        self.rebuild_secondary_indexes();
+
+        self.metadata.times_modified += 1;
+
         Ok(())
     }
 
+    /// Brings the pair of columns at col_index onto a shared text representation for a
+    /// merge. Self's column is rewritten in place when it has to change; the returned
+    /// column stands in for other's when that side has to change, None when it already
+    /// matches. When both sides are dictionary encoded over different dictionaries they
+    /// are re-expressed over the union dictionary, or decoded to plain Texts in the rare
+    /// case where the union passes DICT_MAX_CARDINALITY.
+    fn normalize_for_merge(&mut self, col_index: usize, other: &DbVec) -> Option<DbVec> {
+        let (replacement, converted) = match (&self.table[col_index], other) {
+            (DbVec::Texts { name, col: _ }, DbVec::DictTexts { name: _, dict, codes }) => {
+                (None, Some(DbVec::Texts { name: name.clone(), col: decode_dict_column(dict, codes) }))
+            },
+            (DbVec::DictTexts { name, dict, codes }, DbVec::Texts { name: _, col: other_col }) => {
+                match union_dict(dict, other_col) {
+                    Some(union) => {
+                        let self_codes = remap_codes(codes, dict, &union);
+                        let other_codes = encode_with_dict(other_col, &union);
+                        (Some(DbVec::DictTexts { name: name.clone(), dict: union.clone(), codes: self_codes }),
+                         Some(DbVec::DictTexts { name: name.clone(), dict: union, codes: other_codes }))
+                    },
+                    None => {
+                        (Some(DbVec::Texts { name: name.clone(), col: decode_dict_column(dict, codes) }), None)
+                    },
+                }
+            },
+            (DbVec::DictTexts { name, dict, codes }, DbVec::DictTexts { name: _, dict: other_dict, codes: other_codes }) => {
+                if dict == other_dict {
+                    (None, None)
+                } else {
+                    match union_dict(dict, other_dict) {
+                        Some(union) => {
+                            let self_codes = remap_codes(codes, dict, &union);
+                            let new_other_codes = remap_codes(other_codes, other_dict, &union);
+                            (Some(DbVec::DictTexts { name: name.clone(), dict: union.clone(), codes: self_codes }),
+                             Some(DbVec::DictTexts { name: name.clone(), dict: union, codes: new_other_codes }))
+                        },
+                        None => {
+                            (Some(DbVec::Texts { name: name.clone(), col: decode_dict_column(dict, codes) }),
+                             Some(DbVec::Texts { name: name.clone(), col: decode_dict_column(other_dict, other_codes) }))
+                        },
+                    }
+                }
+            },
+            _ => (None, None),
+        };
+        if let Some(replacement) = replacement {
+            self.table[col_index] = replacement;
+        }
+        converted
+    }
+
     pub fn len(&self) -> usize {
         let len: usize;
         match &self.table[0] {
             DbVec::Floats { name: _, col } => len = col.len(),
             DbVec::Ints { name: _, col } => len = col.len(),
             DbVec::Texts { name: _, col } => len = col.len(),
+            DbVec::DictTexts { name: _, dict: _, codes } => len = codes.len(),
         }
         len
     }
 
+    /// Rough number of bytes this table holds in memory. Used by the cache eviction pass to
+    /// keep the sum of all loaded tables under the configured memory budget.
+    pub fn byte_size(&self) -> usize {
+        let mut total = 0;
+        for v in &self.table {
+            match v {
+                DbVec::Ints { name: _, col } => total += col.len() * std::mem::size_of::<i64>(),
+                DbVec::Floats { name: _, col } => total += col.len() * std::mem::size_of::<f64>(),
+                DbVec::Texts { name: _, col } => {
+                    for text in col {
+                        total += std::mem::size_of::<KeyString>();
+                        // SmartString stores short strings inline, so only spilled ones add heap bytes.
+                        if text.is_inline() == false {
+                            total += text.len();
+                        }
+                    }
+                },
+                DbVec::DictTexts { name: _, dict, codes } => {
+                    total += codes.len() * std::mem::size_of::<u32>();
+                    for text in dict {
+                        total += std::mem::size_of::<KeyString>();
+                        if text.is_inline() == false {
+                            total += text.len();
+                        }
+                    }
+                },
+            }
+        }
+        total
+    }
+
+    /// True if the primary key column is already in ascending order.
+    fn is_sorted_by_primary_key(&self) -> bool {
+        match &self.table[self.get_primary_key_col_index()] {
+            DbVec::Ints { name: _, col } => col.windows(2).all(|w| w[0] <= w[1]),
+            DbVec::Texts { name: _, col } => col.windows(2).all(|w| w[0] <= w[1]),
+            DbVec::Floats { name: _, col: _ } => unreachable!("There should never be a float primary key"),
+            DbVec::DictTexts { name: _, dict: _, codes: _ } => unreachable!("Primary key columns are never dictionary encoded"),
+        }
+    }
+
     pub fn sort(&mut self) {
 
+        // Uploads and csv exports are usually already in primary key order, so a linear
+        // check beats unconditionally permuting every column.
+        if self.is_sorted_by_primary_key() {
+            return
+        }
+
         let len = self.len();
 
         let mut indexer: Vec<usize> = (0..len).collect();
-        
+
         let primary_index = self.get_primary_key_col_index();
 
         let vec = &mut self.table[primary_index];
@@ -774,25 +1481,90 @@ impl ColumnTable {
             DbVec::Floats { name: _, col: _ } => {
                 unreachable!("There should never be a float primary key");
             },
+            DbVec::DictTexts { name: _, dict: _, codes: _ } => {
+                unreachable!("Primary key columns are never dictionary encoded");
+            },
         }
 
-        self.table.iter_mut().for_each(|vec| {
-            match vec {
-            DbVec::Floats { name: _, col } => {
-                rearrange_by_index(col, &indexer);
-            },
-            DbVec::Ints { name: _, col } => {
-                rearrange_by_index(col, &indexer);
-            },
-            DbVec::Texts { name: _, col } => {
-                rearrange_by_index(col, &indexer);
+        if len >= PARALLEL_ROW_THRESHOLD && self.table.len() > 1 {
+            // Each column's rearrange is independent once the indexer exists, so it fans
+            // out one scoped thread per column. Every thread copies the indexer as its own
+            // scratch; at these sizes the copies are noise next to the rearranging itself.
+            let indexer_ref = &indexer;
+            std::thread::scope(|scope| {
+                for column in self.table.iter_mut() {
+                    scope.spawn(move || {
+                        let mut scratch: Vec<usize> = Vec::with_capacity(indexer_ref.len());
+                        permute_column(column, indexer_ref, &mut scratch);
+                    });
+                }
+            });
+        } else {
+            // The scratch buffer is refilled from the indexer for each column, so sorting
+            // allocates two index vectors in total instead of a cloned copy of every column.
+            let mut scratch: Vec<usize> = Vec::with_capacity(len);
+            for column in self.table.iter_mut() {
+                permute_column(column, &indexer, &mut scratch);
+            }
+        }
+        // The indexer is not needed after this point, so the tombstones destroy it in
+        // place instead of copying it one more time.
+        apply_permutation_in_place(&mut self.tombstones, &mut indexer);
+    }
+
+    /// Renders the given rows as csv lines. With a projection only the listed column
+    /// positions are touched, so a narrow query over a wide table pays for the columns it
+    /// asks for instead of the full table width.
+    fn print_rows(&self, row_indexes: &[usize], projection: Option<&[usize]>) -> String {
+        let all_columns: Vec<usize>;
+        let column_indexes: &[usize] = match projection {
+            Some(p) => p,
+            None => {
+                all_columns = (0..self.table.len()).collect();
+                &all_columns
             },
+        };
+
+        // One allocation up front; the cells are then formatted straight into it with no
+        // per-cell Strings.
+        let mut printer = String::with_capacity(row_indexes.len() * (column_indexes.len() * 12 + 1));
+        for &index in row_indexes {
+            if self.tombstones[index] {
+                continue
             }
-        });
+            for &column in column_indexes {
+                match &self.table[column] {
+                    DbVec::Floats { name: _, col } => push_f64(&mut printer, col[index]),
+                    DbVec::Ints { name: _, col } => push_i64(&mut printer, col[index]),
+                    DbVec::Texts { name: _, col } => printer.push_str(&col[index]),
+                    DbVec::DictTexts { name: _, dict, codes } => printer.push_str(&dict[codes[index] as usize]),
+                }
+                printer.push(';');
+            }
+            printer.pop();
+            printer.push('\n');
+        }
+        printer.pop();
+        printer
     }
 
-    pub fn query_list(&self, mut key_list: Vec<&str>) -> Result<String, StrictError> {
-        let mut printer = String::new();
+    /// Resolves a comma separated list of column names to their positions in the table.
+    pub fn projection_indexes(&self, columns: &str) -> Result<Vec<usize>, StrictError> {
+        let mut indexes = Vec::new();
+        for column in columns.split(',') {
+            match self.get_column_index(column) {
+                Some(index) => indexes.push(index),
+                None => return Err(StrictError::Query(format!("There is no column named '{}'", column))),
+            }
+        }
+        Ok(indexes)
+    }
+
+    pub fn query_list(&self, key_list: Vec<&str>) -> Result<String, StrictError> {
+        self.query_list_projected(key_list, None)
+    }
+
+    pub fn query_list_projected(&self, mut key_list: Vec<&str>, projection: Option<&[usize]>) -> Result<String, StrictError> {
         let primary_index = self.get_primary_key_col_index();
         key_list.sort();
 
@@ -810,265 +1582,868 @@ impl ColumnTable {
                     match col.binary_search(&key) {
                         Ok(num) => index = num,
                         Err(_) => continue,
-                    } 
-                    indexes.push(index);
+                    }
+                    indexes.push(index);
+                },
+                DbVec::Texts { name: _, col } => {
+                    let index: usize;
+                    match col.binary_search(&KeyString::from(item)) {
+                        Ok(num) => index = num,
+                        Err(_) => continue,
+                    }
+                    indexes.push(index);
+                },
+                DbVec::DictTexts { name: _, dict: _, codes: _ } => unreachable!("Primary key columns are never dictionary encoded"),
+
+            }
+        }
+
+        Ok(self.print_rows(&indexes, projection))
+    }
+
+    pub fn query_range(&self, range: (&str, &str)) -> Result<String, StrictError> {
+        self.query_range_projected(range, None)
+    }
+
+    pub fn query_range_projected(&self, range: (&str, &str), projection: Option<&[usize]>) -> Result<String, StrictError> {
+        if range.1 < range.0 && range.1 != "" {
+            return Err(StrictError::Empty)
+        }
+
+        if self.len() == 0 {
+            return Ok(String::new())
+        }
+
+        let (first, last) = self.range_indexes(range)?;
+        if last < first || last >= self.len() {
+            return Ok(String::new())
+        }
+
+        let row_indexes: Vec<usize> = (first..=last).collect();
+        Ok(self.print_rows(&row_indexes, projection))
+    }
+
+    pub fn query(&self, query: &str) -> Result<String, StrictError> {
+        self.query_list(Vec::from([query]))
+    }
+
+    /// Maps an inclusive primary key range to the first and last row index it covers.
+    /// An empty upper bound means "to the end of the table". An empty range comes back
+    /// as (1, 0), which the callers already treat as "no rows".
+    fn range_indexes(&self, range: (&str, &str)) -> Result<(usize, usize), StrictError> {
+        let primary_index = self.get_primary_key_col_index();
+        match &self.table[primary_index] {
+            DbVec::Floats { name: _, col: _ } => Err(StrictError::FloatPrimaryKey),
+            DbVec::Ints { name: _, col } => {
+                let start = match range.0.parse::<i64>() {
+                    Ok(num) => num,
+                    Err(_) => return Err(StrictError::WrongKey),
+                };
+                let first = col.partition_point(|n| n < &start);
+                let last: usize;
+                if range.1 == "" {
+                    last = col.len().saturating_sub(1);
+                } else {
+                    let end = match range.1.parse::<i64>() {
+                        Ok(num) => num,
+                        Err(_) => return Err(StrictError::WrongKey),
+                    };
+                    // The end stays exclusive until the range is known to be non-empty:
+                    // subtracting 1 first would wrongly cover row 0 whenever every key
+                    // is above the upper bound.
+                    let last_excl = col.partition_point(|n| n <= &end);
+                    if last_excl <= first {
+                        return Ok((1, 0));
+                    }
+                    last = last_excl - 1;
+                }
+                Ok((first, last))
+            },
+            DbVec::Texts { name: _, col } => {
+                let first = col.partition_point(|n| n < &KeyString::from(range.0));
+                let last: usize;
+                if range.1 == "" {
+                    last = col.len().saturating_sub(1);
+                } else {
+                    let last_excl = col.partition_point(|n| n <= &KeyString::from(range.1));
+                    if last_excl <= first {
+                        return Ok((1, 0));
+                    }
+                    last = last_excl - 1;
+                }
+                Ok((first, last))
+            },
+            DbVec::DictTexts { name: _, dict: _, codes: _ } => unreachable!("Primary key columns are never dictionary encoded"),
+        }
+    }
+
+    /// Returns the position of the named column in the table, or None if there is no such column.
+    pub fn get_column_index(&self, column: &str) -> Option<usize> {
+        let mut i = 0;
+        for v in &self.table {
+            let name = match v {
+                DbVec::Floats { name, col: _ } => name,
+                DbVec::Ints { name, col: _ } => name,
+                DbVec::Texts { name, col: _ } => name,
+                DbVec::DictTexts { name, dict: _, codes: _ } => name,
+            };
+            if name == column {
+                return Some(i);
+            }
+            i += 1;
+        }
+        None
+    }
+
+    /// Builds a secondary index over the named column. The index is a permutation of the row
+    /// indexes sorted by that column's values, so query_secondary can binary search columns
+    /// other than the primary key. Float columns cannot be indexed since floats have no total
+    /// order. The index is kept in sync by update().
+    pub fn add_secondary_index(&mut self, column: &str) -> Result<(), StrictError> {
+        let column_index = match self.get_column_index(column) {
+            Some(index) => index,
+            None => return Err(StrictError::Query(format!("There is no column named '{}'", column))),
+        };
+
+        let permutation: Vec<usize>;
+        match &self.table[column_index] {
+            DbVec::Ints { name: _, col } => {
+                let mut perm: Vec<usize> = (0..col.len()).collect();
+                perm.sort_by_key(|&index| col[index]);
+                permutation = perm;
+            },
+            DbVec::Texts { name: _, col } => {
+                let mut perm: Vec<usize> = (0..col.len()).collect();
+                perm.sort_by(|&a, &b| col[a].cmp(&col[b]));
+                permutation = perm;
+            },
+            // The dictionary is sorted, so sorting by code sorts by string - with integer
+            // comparisons instead of string comparisons.
+            DbVec::DictTexts { name: _, dict: _, codes } => {
+                let mut perm: Vec<usize> = (0..codes.len()).collect();
+                perm.sort_by_key(|&index| codes[index]);
+                permutation = perm;
+            },
+            DbVec::Floats { name: _, col: _ } => {
+                return Err(StrictError::Query("Float columns cannot be indexed".to_owned()));
+            },
+        }
+
+        self.secondary_indexes.insert(KeyString::from(column), permutation);
+        Ok(())
+    }
+
+    /// Rebuilds every secondary index after a write. update() merges and re-sorts whole
+    /// columns, so the old row indexes are stale and a rebuild is the cheapest fix.
+    fn rebuild_secondary_indexes(&mut self) {
+        let columns: Vec<KeyString> = self.secondary_indexes.keys().cloned().collect();
+        for column in columns {
+            // Can only fail if the column disappeared, and update() never removes columns.
+            let _ = self.add_secondary_index(&column);
+        }
+    }
+
+    /// Looks up all rows whose value in the named column equals the given key. Uses the
+    /// secondary index when one exists, otherwise falls back to a linear scan, so the lookup
+    /// runs server side either way. Rows are returned in primary key order.
+    pub fn query_secondary(&self, column: &str, key: &str) -> Result<String, StrictError> {
+        self.query_secondary_projected(column, key, None)
+    }
+
+    pub fn query_secondary_projected(&self, column: &str, key: &str, projection: Option<&[usize]>) -> Result<String, StrictError> {
+        let column_index = match self.get_column_index(column) {
+            Some(index) => index,
+            None => return Err(StrictError::Query(format!("There is no column named '{}'", column))),
+        };
+
+        let mut row_indexes: Vec<usize> = Vec::new();
+        match &self.table[column_index] {
+            DbVec::Ints { name: _, col } => {
+                let key = match key.parse::<i64>() {
+                    Ok(num) => num,
+                    Err(_) => return Err(StrictError::Query(format!("'{}' is not an integer", key))),
+                };
+                match self.secondary_indexes.get(column) {
+                    Some(perm) => {
+                        let mut i = perm.partition_point(|&index| col[index] < key);
+                        while i < perm.len() && col[perm[i]] == key {
+                            row_indexes.push(perm[i]);
+                            i += 1;
+                        }
+                    },
+                    None => {
+                        let mut i = 0;
+                        for value in col {
+                            if *value == key {
+                                row_indexes.push(i);
+                            }
+                            i += 1;
+                        }
+                    },
+                }
+            },
+            DbVec::Texts { name: _, col } => {
+                let key = KeyString::from(key);
+                match self.secondary_indexes.get(column) {
+                    Some(perm) => {
+                        let mut i = perm.partition_point(|&index| col[index] < key);
+                        while i < perm.len() && col[perm[i]] == key {
+                            row_indexes.push(perm[i]);
+                            i += 1;
+                        }
+                    },
+                    None => {
+                        let mut i = 0;
+                        for value in col {
+                            if *value == key {
+                                row_indexes.push(i);
+                            }
+                            i += 1;
+                        }
+                    },
+                }
+            },
+            DbVec::DictTexts { name: _, dict, codes } => {
+                // A value missing from the dictionary appears in no row, so the lookup is
+                // over before it starts; otherwise the search runs on u32 codes.
+                if let Ok(key) = dict.binary_search(&KeyString::from(key)) {
+                    let key = key as u32;
+                    match self.secondary_indexes.get(column) {
+                        Some(perm) => {
+                            let mut i = perm.partition_point(|&index| codes[index] < key);
+                            while i < perm.len() && codes[perm[i]] == key {
+                                row_indexes.push(perm[i]);
+                                i += 1;
+                            }
+                        },
+                        None => {
+                            let mut i = 0;
+                            for code in codes {
+                                if *code == key {
+                                    row_indexes.push(i);
+                                }
+                                i += 1;
+                            }
+                        },
+                    }
+                }
+            },
+            DbVec::Floats { name: _, col: _ } => {
+                return Err(StrictError::Query("Float columns cannot be searched by value".to_owned()));
+            },
+        }
+
+        row_indexes.sort();
+
+        Ok(self.print_rows(&row_indexes, projection))
+    }
+
+    /// Computes SUM, MIN, MAX, AVG or COUNT over the named column, optionally restricted
+    /// to a primary key range. The columns are dense Vec<i64>/Vec<f64> so these loops are
+    /// simple linear scans, and only the single result number travels over the wire.
+    pub fn aggregate_query(&self, function: &str, column: &str, range: Option<(&str, &str)>) -> Result<String, StrictError> {
+        let column_index = match self.get_column_index(column) {
+            Some(index) => index,
+            None => return Err(StrictError::Query(format!("There is no column named '{}'", column))),
+        };
+
+        if self.len() == 0 {
+            return Err(StrictError::Empty);
+        }
+
+        let (first, last) = match range {
+            Some(range) => self.range_indexes(range)?,
+            None => (0, self.len() - 1),
+        };
+        if last < first || last >= self.len() {
+            return Err(StrictError::Empty);
+        }
+
+        // Tombstoned rows must not count, but the dense slice fast path below only works
+        // when the range has none, which is the common case.
+        let has_tombstones = self.tombstones[first..=last].iter().any(|&dead| dead);
+
+        match &self.table[column_index] {
+            DbVec::Ints { name: _, col } => {
+                let live: Vec<i64>;
+                let slice: &[i64];
+                if has_tombstones {
+                    live = (first..=last).filter(|&i| !self.tombstones[i]).map(|i| col[i]).collect();
+                    slice = &live;
+                } else {
+                    slice = &col[first..=last];
+                }
+                if slice.is_empty() {
+                    return Err(StrictError::Empty);
+                }
+                match function {
+                    "SUM" => Ok(slice.iter().sum::<i64>().to_string()),
+                    "MIN" => Ok(slice.iter().min().unwrap().to_string()),
+                    "MAX" => Ok(slice.iter().max().unwrap().to_string()),
+                    "AVG" => Ok((slice.iter().sum::<i64>() as f64 / slice.len() as f64).to_string()),
+                    "COUNT" => Ok(slice.len().to_string()),
+                    _ => Err(StrictError::Query(format!("'{}' is not an aggregate function", function))),
+                }
+            },
+            DbVec::Floats { name: _, col } => {
+                let live: Vec<f64>;
+                let slice: &[f64];
+                if has_tombstones {
+                    live = (first..=last).filter(|&i| !self.tombstones[i]).map(|i| col[i]).collect();
+                    slice = &live;
+                } else {
+                    slice = &col[first..=last];
+                }
+                if slice.is_empty() {
+                    return Err(StrictError::Empty);
+                }
+                match function {
+                    "SUM" => Ok(slice.iter().sum::<f64>().to_string()),
+                    "MIN" => Ok(slice.iter().fold(f64::INFINITY, |acc, &x| acc.min(x)).to_string()),
+                    "MAX" => Ok(slice.iter().fold(f64::NEG_INFINITY, |acc, &x| acc.max(x)).to_string()),
+                    "AVG" => Ok((slice.iter().sum::<f64>() / slice.len() as f64).to_string()),
+                    "COUNT" => Ok(slice.len().to_string()),
+                    _ => Err(StrictError::Query(format!("'{}' is not an aggregate function", function))),
+                }
+            },
+            DbVec::Texts { name: _, col: _ } | DbVec::DictTexts { name: _, dict: _, codes: _ } => {
+                match function {
+                    "COUNT" => Ok((first..=last).filter(|&i| !self.tombstones[i]).count().to_string()),
+                    _ => Err(StrictError::Query(format!("Only COUNT works on text columns, not {}", function))),
+                }
+            },
+        }
+    }
+
+    /// Marks the rows with the given primary keys as deleted. The rows stay in the columns
+    /// as tombstones until the next compaction, so deleting a few rows costs a few binary
+    /// searches and flag writes instead of rewriting the table. Returns how many rows were
+    /// newly deleted; keys that do not exist or are already dead are skipped.
+    pub fn delete_list(&mut self, key_list: Vec<&str>) -> Result<usize, StrictError> {
+        let primary_index = self.get_primary_key_col_index();
+
+        let mut deleted = 0;
+        for item in key_list {
+            let index = match &self.table[primary_index] {
+                DbVec::Floats { name: _, col: _ } => return Err(StrictError::FloatPrimaryKey),
+                DbVec::Ints { name: _, col } => {
+                    match item.parse::<i64>() {
+                        Ok(num) => match col.binary_search(&num) {
+                            Ok(i) => i,
+                            Err(_) => continue,
+                        },
+                        Err(_) => continue,
+                    }
                 },
                 DbVec::Texts { name: _, col } => {
-                    let index: usize;
                     match col.binary_search(&KeyString::from(item)) {
-                        Ok(num) => index = num,
+                        Ok(i) => i,
                         Err(_) => continue,
-                    } 
-                    indexes.push(index);
-                }
-
+                    }
+                },
+                DbVec::DictTexts { name: _, dict: _, codes: _ } => unreachable!("Primary key columns are never dictionary encoded"),
+            };
+            if !self.tombstones[index] {
+                self.tombstones[index] = true;
+                deleted += 1;
             }
         }
 
-        for index in indexes {
-            for v in &self.table {
-                match v {
-                    DbVec::Floats { name: _, col } => printer.push_str(&col[index].to_string()),
-                    DbVec::Ints { name: _, col } => printer.push_str(&col[index].to_string()),
-                    DbVec::Texts { name: _, col } => printer.push_str(&col[index]),
-                }
-                printer.push(';');
+        if deleted > 0 {
+            self.metadata.times_modified += 1;
+        }
+        Ok(deleted)
+    }
+
+    /// Marks every row in the given primary key range as deleted. See delete_list.
+    pub fn delete_range(&mut self, range: (&str, &str)) -> Result<usize, StrictError> {
+        if self.len() == 0 {
+            return Ok(0)
+        }
+        let (first, last) = self.range_indexes(range)?;
+        if last < first || last >= self.len() {
+            return Ok(0)
+        }
+
+        let mut deleted = 0;
+        for i in first..=last {
+            if !self.tombstones[i] {
+                self.tombstones[i] = true;
+                deleted += 1;
             }
-            printer.pop();
-            printer.push('\n');
         }
-        printer.pop();
-        
-        Ok(printer)
+
+        if deleted > 0 {
+            self.metadata.times_modified += 1;
+        }
+        Ok(deleted)
     }
 
-    pub fn query_range(&self, range: (&str, &str)) -> Result<String, StrictError> {
-        let mut printer = String::new();
+    /// How many rows are currently tombstoned.
+    pub fn tombstone_count(&self) -> usize {
+        self.tombstones.iter().filter(|&&dead| dead).count()
+    }
 
-        if range.1 < range.0 {
-            return Err(StrictError::Empty)
+    /// Physically removes the tombstoned rows by shifting the live elements of every column
+    /// down over the dead ones, in place and in order. Called by the save loop once the
+    /// tombstone fraction passes TOMBSTONE_COMPACT_RATIO. Returns how many rows were removed.
+    pub fn compact(&mut self) -> usize {
+        let removed = self.tombstone_count();
+        if removed == 0 {
+            return 0
         }
 
-        if range.0 == range.1 {
-            return self.query(range.0);
+        for vec in &mut self.table {
+            match vec {
+                DbVec::Ints { name: _, col } => compact_by_tombstones(col, &self.tombstones),
+                DbVec::Floats { name: _, col } => compact_by_tombstones(col, &self.tombstones),
+                DbVec::Texts { name: _, col } => compact_by_tombstones(col, &self.tombstones),
+                // A compaction can leave dictionary entries with no remaining rows; that is
+                // harmless and the dictionary is rebuilt tight on the next reload.
+                DbVec::DictTexts { name: _, dict: _, codes } => compact_by_tombstones(codes, &self.tombstones),
+            }
         }
 
-        let primary_index = self.get_primary_key_col_index();
+        self.tombstones.clear();
+        self.tombstones.resize(self.len(), false);
+        self.rebuild_secondary_indexes();
+        self.metadata.times_modified += 1;
 
-        let mut indexes: [usize;2] = [0,0];
-        match &self.table[primary_index] {
-            DbVec::Floats { name: _, col: _ } => return Err(StrictError::FloatPrimaryKey),
-            DbVec::Ints { name: _, col } => {
-                let key = match range.0.parse::<i64>() {
-                    Ok(num) => num,
-                    Err(_) => return Err(StrictError::Empty),
-                };
-                let index: usize = col.partition_point(|n| n < &key);
-                indexes[0] = index;
+        removed
+    }
 
-                if range.1 == "" {
-                    indexes[1] = col.len();
-                } else {
-                    let key2 = match range.1.parse::<i64>() {
-                        Ok(num) => num,
-                        Err(_) => return Err(StrictError::WrongKey),
-                    };
-                    // // println!("key2: {}", key2);
-                    let index: usize = col.partition_point(|n| n < &key2);
-                    if col[index] == key2 {
-                        indexes[1] = index;
-                    } else {
-                        indexes[1] = index - 1;
-                    }
-                }
+    pub fn save_to_disk_raw(&self, path: &str) -> Result<(), StrictError> {
+        let file_name = &self.name;
 
-            },
-            DbVec::Texts { name: _, col } => {
-                let index: usize = col.partition_point(|n| n < &KeyString::from(range.0));
-                indexes[0] = index;
+        let metadata = &self.metadata.to_string();
 
-                if range.1 == "" {
-                    indexes[1] = col.len();
-                }
+        // The snapshot is the binary columnar format, so loading it back is a handful of
+        // bulk copies into the column Vecs instead of a per-cell text parse. Written to a
+        // temp file first and renamed into place so a crash mid-save cannot leave a
+        // half-written table behind. The body is compressed; the small metadata file
+        // stays raw so it can still be eyeballed in a text editor.
+        let table = self.to_binary();
 
-                let index: usize = col.partition_point(|n| n < &KeyString::from(range.1));
+        atomic_write(&format!("{}raw_tables/{}", path, file_name), &compress_for_disk(&table))?;
+        atomic_write(&format!("{}raw_tables-metadata/{}", path, file_name), metadata.as_bytes())?;
 
-                if col[index] == range.1 {
-                    indexes[1] = index;
-                } else {
-                    indexes[1] = index - 1;
-                }
+        Ok(())
+    }
 
-                indexes[1] = index;
-            }
+
+}
+
+/// Writes the data to a temporary file next to the target and atomically renames it over
+/// the target, so readers never see a partially written file even if we crash mid-write.
+pub fn atomic_write(target: &str, data: &[u8]) -> Result<(), StrictError> {
+    let temp_path = format!("{}.tmp", target);
+
+    let mut temp_file = match std::fs::File::create(&temp_path) {
+        Ok(f) => f,
+        Err(e) => return Err(StrictError::Io(e.kind())),
+    };
+    match temp_file.write_all(data) {
+        Ok(_) => (),
+        Err(e) => return Err(StrictError::Io(e.kind())),
+    };
+    match temp_file.sync_all() {
+        Ok(_) => (),
+        Err(e) => return Err(StrictError::Io(e.kind())),
+    };
+    match std::fs::rename(&temp_path, target) {
+        Ok(_) => (),
+        Err(e) => return Err(StrictError::Io(e.kind())),
+    };
+
+    Ok(())
+}
+
+/// Appends one integer cell to the output buffer, formatted on the stack. Skips the
+/// intermediate heap String that to_string() allocates per cell, which matters when a
+/// range query renders a million rows.
+#[inline]
+pub fn push_i64(printer: &mut String, num: i64) {
+    let mut buffer = itoa::Buffer::new();
+    printer.push_str(buffer.format(num));
+}
+
+/// The float counterpart of push_i64. Note that ryu always keeps a fractional part, so
+/// 5.0 renders as "5.0" where to_string() gave "5"; the csv parser accepts both.
+#[inline]
+pub fn push_f64(printer: &mut String, num: f64) {
+    let mut buffer = ryu::Buffer::new();
+    printer.push_str(buffer.format(num));
+}
+
+/// Magic prefix marking a compressed file written by the save loop. Files without it load
+/// as-is, so tables saved before compression existed keep working.
+pub const COMPRESSED_FILE_MAGIC: [u8; 4] = *b"EZLZ";
+
+/// Compresses data for disk when it is big enough to be worth the codec overhead. The
+/// csv tables are redundant enough that the save loop typically writes a fraction of the
+/// raw bytes.
+pub fn compress_for_disk(data: &[u8]) -> Vec<u8> {
+    if data.len() < crate::networking_utilities::COMPRESSION_THRESHOLD {
+        return Vec::from(data);
+    }
+    let mut output = Vec::with_capacity(data.len() / 2);
+    output.extend_from_slice(&COMPRESSED_FILE_MAGIC);
+    output.extend_from_slice(&lz4_flex::compress_prepend_size(data));
+    output
+}
+
+/// Reads a file written through compress_for_disk, transparently decompressing it when it
+/// carries the magic prefix.
+pub fn read_from_disk(path: &str) -> Result<Vec<u8>, StrictError> {
+    let data = match std::fs::read(path) {
+        Ok(d) => d,
+        Err(e) => return Err(StrictError::Io(e.kind())),
+    };
+    if data.len() >= 4 && data[0..4] == COMPRESSED_FILE_MAGIC {
+        match lz4_flex::decompress_size_prepended(&data[4..]) {
+            Ok(decompressed) => Ok(decompressed),
+            Err(_) => Err(StrictError::BinaryFormat(0)),
         }
+    } else {
+        Ok(data)
+    }
+}
 
-        let mut i = indexes[0];
-        while i <= indexes[1] {
-            for v in &self.table {
-                match v {
-                    DbVec::Floats { name: _, col } => printer.push_str(&col[i].to_string()),
-                    DbVec::Ints { name: _, col } => printer.push_str(&col[i].to_string()),
-                    DbVec::Texts { name: _, col } => printer.push_str(&col[i]),
-                }
-                printer.push(';');
-            }
-            printer.pop();
-            printer.push('\n');
-            i += 1;
+/// Parses the csv cells of a body (everything after the header line) into one typed column
+/// per header item. Single pass: delimiters are found with a word-at-a-time scan and cells
+/// are appended straight into the typed columns, so there is no intermediate Vec<Vec<&str>>
+/// transpose like the old parser had. first_line is the 1-based number of the body's first
+/// row in the original csv, so errors from a parallel chunk still point at the right line.
+fn parse_csv_cells(body: &[u8], header: &[HeaderItem], rows: usize, first_line: usize) -> Result<Vec<DbVec>, StrictError> {
+    let ncols = header.len();
+
+    let mut result: Vec<DbVec> = header.iter().map(|item| match item.kind {
+        DbType::Int => DbVec::Ints { name: item.name.clone(), col: Vec::with_capacity(rows) },
+        DbType::Float => DbVec::Floats { name: item.name.clone(), col: Vec::with_capacity(rows) },
+        DbType::Text => DbVec::Texts { name: item.name.clone(), col: Vec::with_capacity(rows) },
+    }).collect();
+
+    let mut pos: usize = 0;
+    let mut col_index: usize = 0;
+    let mut line_num: usize = first_line;
+    while pos < body.len() {
+        let end = find_cell_end(body, pos);
+        let mut cell = &body[pos..end];
+        let ends_line = end == body.len() || body[end] == b'\n';
+
+        // The str::lines() parser this replaced trimmed CRLF line endings, so the byte
+        // parser must too: a stray \r fails the numeric parsers on the last column and
+        // silently corrupts text cells.
+        if ends_line && cell.last() == Some(&b'\r') {
+            cell = &cell[..cell.len() - 1];
         }
-        printer.pop();
 
-        Ok(printer)
-    }
+        if col_index >= ncols {
+            return Err(StrictError::MoreItemsThanHeader(line_num))
+        }
 
-    pub fn query(&self, query: &str) -> Result<String, StrictError> {
-        self.query_list(Vec::from([query]))
+        match &mut result[col_index] {
+            DbVec::Ints { name: _, col } => {
+                match parse_int_fast(cell) {
+                    Some(num) => col.push(num),
+                    None => return Err(StrictError::Parse(line_num)),
+                };
+            },
+            DbVec::Floats { name: _, col } => {
+                match parse_float_fast(cell) {
+                    Some(num) => col.push(num),
+                    None => return Err(StrictError::Parse(line_num)),
+                };
+            },
+            DbVec::Texts { name: _, col } => {
+                // Safe: body comes from a &str and cells are only split at ascii bytes,
+                // which can never land inside a multi-byte utf-8 sequence.
+                col.push(KeyString::from(unsafe { str::from_utf8_unchecked(cell) }));
+            },
+            DbVec::DictTexts { name: _, dict: _, codes: _ } => unreachable!("Columns are parsed plain; encoding happens after the table is assembled"),
+        }
+        col_index += 1;
+
+        if ends_line {
+            if col_index != ncols {
+                return Err(StrictError::FewerItemsThanHeader(line_num))
+            }
+            col_index = 0;
+            line_num += 1;
+        }
+        pos = end + 1;
     }
 
-    pub fn save_to_disk_raw(&self, path: &str) -> Result<(), StrictError> {
-        let file_name = &self.name;
+    Ok(result)
+}
 
-        let metadata = &self.metadata.to_string();
+/// Moves the rows of a chunk's column onto the end of the combined column. Chunks of the
+/// same csv always parse to the same column types, so a mismatch cannot happen.
+fn append_parsed_column(column: &mut DbVec, parsed: DbVec) {
+    match (column, parsed) {
+        (DbVec::Ints { name: _, col }, DbVec::Ints { name: _, col: mut more }) => col.append(&mut more),
+        (DbVec::Floats { name: _, col }, DbVec::Floats { name: _, col: mut more }) => col.append(&mut more),
+        (DbVec::Texts { name: _, col }, DbVec::Texts { name: _, col: mut more }) => col.append(&mut more),
+        _ => unreachable!("Chunks of the same csv parse to the same column types"),
+    }
+}
 
-        let table = &self.to_string();
+/// Finds the end of the cell starting at `from`, i.e. the index of the next ';' or '\n'
+/// (or the end of the buffer). Scans 8 bytes at a time with the usual SWAR trick so the
+/// csv parser is not limited by a byte-by-byte loop.
+#[inline]
+fn find_cell_end(bytes: &[u8], from: usize) -> usize {
 
+    #[inline(always)]
+    fn contains_byte(word: u64, byte: u8) -> u64 {
+        let pattern = (byte as u64) * 0x0101010101010101;
+        let x = word ^ pattern;
+        x.wrapping_sub(0x0101010101010101) & !x & 0x8080808080808080
+    }
 
-        let mut table_file = match std::fs::File::create(format!("{}raw_tables/{}",path, file_name)) {
-            Ok(f) => f,
-            Err(e) => return Err(StrictError::Io(e.kind())),
-        };
+    let mut i = from;
+    while i + 8 <= bytes.len() {
+        let word = u64::from_le_bytes(bytes[i..i+8].try_into().expect("8 byte slice always converts"));
+        let hit = contains_byte(word, b';') | contains_byte(word, b'\n');
+        if hit != 0 {
+            return i + (hit.trailing_zeros() / 8) as usize
+        }
+        i += 8;
+    }
+    while i < bytes.len() && bytes[i] != b';' && bytes[i] != b'\n' {
+        i += 1;
+    }
+    i
+}
 
-        let mut meta_file = match std::fs::File::create(format!("{}raw_tables-metadata/{}",path, file_name)) {
-            Ok(f) => f,
-            Err(e) => return Err(StrictError::Io(e.kind())),
-        };
+/// Parses an i64 from raw bytes without the utf-8 and radix generality of the stdlib path.
+#[inline]
+fn parse_int_fast(bytes: &[u8]) -> Option<i64> {
+    if bytes.is_empty() {
+        return None
+    }
+    let (negative, digits) = match bytes[0] {
+        b'-' => (true, &bytes[1..]),
+        _ => (false, bytes),
+    };
+    if digits.is_empty() {
+        return None
+    }
+    let mut num: i64 = 0;
+    for &byte in digits {
+        if !byte.is_ascii_digit() {
+            return None
+        }
+        num = num.checked_mul(10)?.checked_add((byte - b'0') as i64)?;
+    }
+    if negative {
+        Some(-num)
+    } else {
+        Some(num)
+    }
+}
 
-        match table_file.write_all(table.as_bytes()) {
-            Ok(_) => (),
-            Err(e) => println!("Error while writing to disk. Error was:\n{}", e),
-        };
-        match meta_file.write_all(metadata.as_bytes()) {
-            Ok(_) => (),
-            Err(e) => println!("Error while writing to disk. Error was:\n{}", e),
-        };
+// Exact f64 powers of ten. 10^22 is the largest power of ten that is exactly representable.
+const POW10: [f64; 23] = [
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+];
 
+/// Parses an f64 from raw bytes. Takes the exact fast path for plain "digits.digits"
+/// numbers whose mantissa fits in 2^53 (one multiply or divide of exactly representable
+/// values is correctly rounded), and falls back to the stdlib parser for exponents and
+/// other rare forms so nothing is lost in precision.
+#[inline]
+fn parse_float_fast(bytes: &[u8]) -> Option<f64> {
+    if bytes.is_empty() {
+        return None
+    }
+    let (negative, digits) = match bytes[0] {
+        b'-' => (true, &bytes[1..]),
+        _ => (false, bytes),
+    };
+    if digits.is_empty() {
+        return None
+    }
 
-        Ok(())
+    let mut mantissa: u64 = 0;
+    let mut mantissa_digits = 0;
+    let mut frac_digits: i32 = -1;
+    for &byte in digits {
+        if byte == b'.' {
+            if frac_digits >= 0 {
+                return None
+            }
+            frac_digits = 0;
+            continue;
+        }
+        if !byte.is_ascii_digit() {
+            // Exponent notation, inf, NaN and friends go through the stdlib parser.
+            return str::from_utf8(bytes).ok()?.parse::<f64>().ok()
+        }
+        mantissa = mantissa * 10 + (byte - b'0') as u64;
+        mantissa_digits += 1;
+        if frac_digits >= 0 {
+            frac_digits += 1;
+        }
+    }
+    if mantissa_digits == 0 {
+        return None
+    }
+    if mantissa_digits > 15 || frac_digits > 22 {
+        // Mantissa might not fit in 2^53 so the fast path can round wrong. Punt.
+        return str::from_utf8(bytes).ok()?.parse::<f64>().ok()
     }
 
-    
+    let mut num = mantissa as f64;
+    if frac_digits > 0 {
+        num /= POW10[frac_digits as usize];
+    }
+    if negative {
+        Some(-num)
+    } else {
+        Some(num)
+    }
+}
+
+/// Shifts the live elements of a column down over the tombstoned ones and truncates, so
+/// compaction is a single in-place pass per column with no extra allocation.
+fn compact_by_tombstones<T>(col: &mut Vec<T>, tombstones: &[bool]) {
+    let mut write = 0;
+    for read in 0..col.len() {
+        if !tombstones[read] {
+            col.swap(write, read);
+            write += 1;
+        }
+    }
+    col.truncate(write);
 }
 
+/// Rearranges col so that col[i] ends up holding the old col[scratch[i]], by walking the
+/// permutation's cycles with swaps. No second copy of the column is allocated and no element
+/// is cloned, which matters for Texts columns where a clone per element used to be paid on
+/// every sort. The scratch permutation is destroyed in the process.
 #[inline]
-fn rearrange_by_index<T: Clone>(col: &mut Vec<T>, indexer: &[usize]) {
+fn apply_permutation_in_place<T>(col: &mut [T], scratch: &mut [usize]) {
 
-    let mut temp = Vec::with_capacity(col.len());
     for i in 0..col.len() {
-        temp.push(col[indexer[i]].clone());
+        if scratch[i] == i {
+            continue
+        }
+        let mut prev = i;
+        let mut j = scratch[i];
+        while j != i {
+            col.swap(prev, j);
+            scratch[prev] = prev;
+            prev = j;
+            j = scratch[j];
+        }
+        scratch[prev] = prev;
     }
-    *col = temp;
 
-} 
+}
+
+/// Rearranges one column by the primary key permutation. The scratch vector is overwritten
+/// with a copy of the indexer, which the cycle walk then destroys. Shared by the serial
+/// sort path, which reuses one scratch across columns, and the parallel path, where each
+/// thread brings its own.
+fn permute_column(column: &mut DbVec, indexer: &[usize], scratch: &mut Vec<usize>) {
+    scratch.clear();
+    scratch.extend_from_slice(indexer);
+    match column {
+        DbVec::Floats { name: _, col } => apply_permutation_in_place(col, scratch),
+        DbVec::Ints { name: _, col } => apply_permutation_in_place(col, scratch),
+        DbVec::Texts { name: _, col } => apply_permutation_in_place(col, scratch),
+        DbVec::DictTexts { name: _, dict: _, codes } => apply_permutation_in_place(codes, scratch),
+    }
+}
 
-fn merge_sorted<T: Ord + Clone + Display + Debug>(one: &[T], two: &[T]) -> (Vec<T>, Vec<u8>) {
-    let mut new_vec: Vec<T> = Vec::with_capacity(one.len() + two.len());
-    let mut record_vec: Vec<u8> = Vec::with_capacity(one.len() + two.len());
+/// Builds the merge plan for combining a sorted delta into a sorted column: one pass over
+/// the two primary key columns that records, per output row, whether it comes from the old
+/// table (1), the delta (2), or the delta overwriting an existing key (3). The plan is then
+/// replayed over every column by merge_with_plan.
+fn merge_plan<T: Ord>(one: &[T], two: &[T], record: &mut Vec<u8>) {
+    record.reserve(one.len() + two.len());
     let mut one_pointer = 0;
     let mut two_pointer = 0;
 
-    // println!("RUNNING merge_sorted()!!!--------------------------------");
-    loop {
-        // println!("one[{one_pointer}]: {}\t\ttwo[{two_pointer}]: {}", one[one_pointer], two[two_pointer]);
-
+    while one_pointer < one.len() && two_pointer < two.len() {
         match one[one_pointer].cmp(&two[two_pointer]) {
             std::cmp::Ordering::Less => {
-                new_vec.push(one[one_pointer].clone());
-                record_vec.push(1);
+                record.push(1);
                 one_pointer += 1;
             },
             std::cmp::Ordering::Equal => {
-                new_vec.push(two[two_pointer].clone());
-                record_vec.push(3);
+                record.push(3);
                 two_pointer += 1;
                 one_pointer += 1;
             },
             std::cmp::Ordering::Greater => {
-                new_vec.push(two[two_pointer].clone());
-                record_vec.push(2);
-                two_pointer += 1;
-            }
-        }
-        // if one[one_pointer] < two[two_pointer] {
-        //     new_vec.push(one[one_pointer].clone());
-        //     record_vec.push(1);
-        //     one_pointer += 1;
-        // } else if one[one_pointer] > two[two_pointer] {
-        //     new_vec.push(two[two_pointer].clone());
-        //     record_vec.push(2);
-        //     two_pointer += 1;
-        // } else if one[one_pointer] == two[two_pointer]{
-        //     new_vec.push(two[two_pointer].clone());
-        //     record_vec.push(3);
-        //     two_pointer += 1;
-        //     one_pointer += 1;
-        // } else {
-        //     unreachable!();
-        // }
-        if one_pointer >= one.len() {
-            new_vec.extend_from_slice(&two[two_pointer..two.len()]);
-            while two_pointer < two.len() {
-                record_vec.push(2);
+                record.push(2);
                 two_pointer += 1;
             }
-            break;
-        } else if two_pointer >= two.len() {
-            new_vec.extend_from_slice(&one[one_pointer..one.len()]);
-            while one_pointer < one.len() {
-                record_vec.push(1);
-                one_pointer += 1;
-            }
-            
-            break;
         }
     }
-    // println!("new_vec.len(): {}\nnew_vec\n{:?}", new_vec.len(), new_vec);
-    // println!("record_vec.len(): {}\nrecord_vec: \n{:?}", record_vec.len(), record_vec);
-    // println!("merge_sorted() FINISHED !!!!!!######################################");
-    // println!("\n\n");
-
-    (new_vec, record_vec)
+    while one_pointer < one.len() {
+        record.push(1);
+        one_pointer += 1;
+    }
+    while two_pointer < two.len() {
+        record.push(2);
+        two_pointer += 1;
+    }
 }
 
-fn merge_in_order<T: Clone + Display>(one: &[T], two: &[T], record_vec: &[u8]) -> Vec<T> {
-    let mut new_vec = Vec::with_capacity(one.len() + two.len());
+/// Replays a merge plan over one column. Runs of rows coming from the same side are copied
+/// with a single extend_from_slice, so the long stretches where one side is exhausted cost a
+/// memcpy instead of an element-by-element loop. The merged column is swapped back into
+/// place and the old allocation becomes the scratch buffer for the next merge.
+fn merge_with_plan<T: Clone>(one: &mut Vec<T>, two: &[T], record: &[u8], scratch: &mut Vec<T>) {
+    scratch.clear();
+    scratch.reserve(record.len());
     let mut one_pointer = 0;
     let mut two_pointer = 0;
-    // // println!("record_vec.len(): {}", record_vec.len());
-    // // println!("one.len():   {}", one.len());
-    // // println!("two.len():   {}", two.len());
-    // println!("record_vec: {:?}", record_vec);
-    for index in record_vec {
-        // //println!("one_p: {}\tone[one_p]: {}\ntwo_p: {}\ttwo[two_p]: {}", one_pointer, one[one_pointer], two_pointer, two[two_pointer]);
-        match index {
+    let mut i = 0;
+    while i < record.len() {
+        let tag = record[i];
+        let mut run = 1;
+        while i + run < record.len() && record[i + run] == tag {
+            run += 1;
+        }
+        match tag {
             1 => {
-                new_vec.push(one[one_pointer].clone());
-                one_pointer += 1;
+                scratch.extend_from_slice(&one[one_pointer..one_pointer + run]);
+                one_pointer += run;
             },
             2 => {
-                new_vec.push(two[two_pointer].clone());
-                two_pointer += 1;
+                scratch.extend_from_slice(&two[two_pointer..two_pointer + run]);
+                two_pointer += run;
             },
             3 => {
-                new_vec.push(two[two_pointer].clone());
-                one_pointer += 1;
-                two_pointer += 1;
-            }
+                scratch.extend_from_slice(&two[two_pointer..two_pointer + run]);
+                one_pointer += run;
+                two_pointer += run;
+            },
             _ => unreachable!("Should always be 1, 2, or 3"),
         }
+        i += run;
     }
+    std::mem::swap(one, scratch);
+    scratch.clear();
+}
 
-    new_vec
+/// Merges one column pair by the precomputed plan with a column-local scratch buffer.
+/// Used by the parallel merge path, where the table's shared scratch buffers cannot cross
+/// threads; merge_with_plan leaves the old allocation in the scratch, so it is freed when
+/// the thread returns.
+fn merge_column_with_plan(column: &mut DbVec, other: &DbVec, record: &[u8]) {
+    match (column, other) {
+        (DbVec::Ints { name: _, col }, DbVec::Ints { name: _, col: other_col }) => merge_with_plan(col, other_col, record, &mut Vec::new()),
+        (DbVec::Floats { name: _, col }, DbVec::Floats { name: _, col: other_col }) => merge_with_plan(col, other_col, record, &mut Vec::new()),
+        (DbVec::Texts { name: _, col }, DbVec::Texts { name: _, col: other_col }) => merge_with_plan(col, other_col, record, &mut Vec::new()),
+        (DbVec::DictTexts { name: _, dict: _, codes }, DbVec::DictTexts { name: _, dict: _, codes: other_codes }) => merge_with_plan(codes, other_codes, record, &mut Vec::new()),
+        _ => unreachable!("Should always have the same type column"),
+    }
 }
 
 
@@ -1096,24 +2471,8 @@ impl Value {
 
         let metadata = &self.metadata.to_string();
 
-        let mut value_file = match std::fs::File::create(&format!("{}key_value/{}",path, file_name)) {
-            Ok(f) => f,
-            Err(e) => return Err(StrictError::Io(e.kind())),
-        };
-
-        let mut meta_file = match std::fs::File::create(&format!("{}key_value-metadata/{}",path, file_name)) {
-            Ok(f) => f,
-            Err(e) => return Err(StrictError::Io(e.kind())),
-        };
-
-        match value_file.write_all(&self.body) {
-            Ok(_) => (),
-            Err(e) => println!("Error while writing to disk. Error was:\n{}", e),
-        };
-        match meta_file.write_all(metadata.as_bytes()) {
-            Ok(_) => (),
-            Err(e) => println!("Error while writing to disk. Error was:\n{}", e),
-        };
+        atomic_write(&format!("{}key_value/{}", path, file_name), &self.body)?;
+        atomic_write(&format!("{}key_value-metadata/{}", path, file_name), metadata.as_bytes())?;
 
         Ok(())
 
@@ -1137,6 +2496,160 @@ mod tests {
 
     }
 
+    #[test]
+    fn test_stricttable_arena_round_trip() {
+        let input = "vnr;heiti;magn\n113035;undirlegg;200\n113050;annad undirlegg;500";
+        let mut t = StrictTable::from_csv_string(input, "test").unwrap();
+        assert_eq!(t.to_csv_string(), input);
+        assert_eq!(t.query_list(vec!["113035"]).unwrap(), "113035;undirlegg;200");
+        assert_eq!(t.query_range(("113035", "113050")).unwrap(), input.split_once('\n').unwrap().1);
+        // Overwrites one row in place and appends a new one past the end.
+        t.update("vnr;heiti;magn\n113035;nytt undirlegg;300\n113060;skrufa;100").unwrap();
+        assert_eq!(t.query_list(vec!["113035", "113060"]).unwrap(), "113035;nytt undirlegg;300\n113060;skrufa;100");
+        assert!(t.query_list(vec!["missing"]).is_err());
+    }
+
+    #[test]
+    fn test_fast_cell_parsers() {
+        assert_eq!(parse_int_fast(b"113035"), Some(113035));
+        assert_eq!(parse_int_fast(b"-42"), Some(-42));
+        assert_eq!(parse_int_fast(b""), None);
+        assert_eq!(parse_int_fast(b"12a"), None);
+        assert_eq!(parse_float_fast(b"1.5"), Some(1.5));
+        assert_eq!(parse_float_fast(b"-0.25"), Some(-0.25));
+        assert_eq!(parse_float_fast(b"3e-5"), Some(3e-5));
+        assert_eq!(parse_float_fast(b"0.6344258428176293"), Some("0.6344258428176293".parse::<f64>().unwrap()));
+        assert_eq!(parse_float_fast(b"not_a_number"), None);
+    }
+
+    #[test]
+    fn test_columntable_parses_crlf_csv() {
+        let input = "vnr,i-p;heiti,t;magn,i\r\n113035;undirlegg;200\r\n113050;annad undirlegg;500\r\n";
+        let t = ColumnTable::from_csv_string(input, "test", "test").unwrap();
+        assert_eq!(t.to_string(), "vnr,i-p;heiti,t;magn,i\n113035;undirlegg;200\n113050;annad undirlegg;500");
+    }
+
+    #[test]
+    fn test_columntable_rejects_uneven_lines() {
+        let too_many = "vnr,i-p;heiti,t\n113035;undirlegg;200";
+        assert!(ColumnTable::from_csv_string(too_many, "test", "test").is_err());
+        let too_few = "vnr,i-p;heiti,t;magn,i\n113035;undirlegg";
+        assert!(ColumnTable::from_csv_string(too_few, "test", "test").is_err());
+    }
+
+    #[test]
+    fn test_columntable_binary_round_trip() {
+        let input = "vnr,i-p;heiti,t;magn,i;lengd,f\n113035;undirlegg;200;1.5\n113050;annad undirlegg;500;3.5";
+        let t = ColumnTable::from_csv_string(input, "test", "test").unwrap();
+        let bin = t.to_binary();
+        let t2 = ColumnTable::from_binary(&bin, "test", "test").unwrap();
+        assert_eq!(t.to_string(), t2.to_string());
+    }
+
+    #[test]
+    fn test_columntable_binary_rejects_garbage() {
+        let garbage: Vec<u8> = vec![1,2,3,4,5,6,7,8,9,10];
+        assert!(ColumnTable::from_binary(&garbage, "test", "test").is_err());
+    }
+
+    #[test]
+    fn test_columntable_binary_rejects_huge_row_count() {
+        // A tiny payload claiming 2^61 rows must fail cleanly instead of wrapping the
+        // bounds checks or aborting in with_capacity.
+        let header = "vnr,i-p;heiti,t";
+        let mut bin: Vec<u8> = Vec::new();
+        bin.extend_from_slice(BIN_TABLE_MAGIC);
+        bin.extend_from_slice(&(header.len() as u64).to_le_bytes());
+        bin.extend_from_slice(header.as_bytes());
+        bin.extend_from_slice(&(1u64 << 61).to_le_bytes());
+        bin.extend_from_slice(&42i64.to_le_bytes());
+        assert!(ColumnTable::from_binary(&bin, "test", "test").is_err());
+    }
+
+    #[test]
+    fn test_dict_encoded_text_column() {
+        // "flokkur" has 3 distinct values over 6 rows, so it loads dictionary encoded;
+        // the primary key column stays plain even though it is text.
+        let input = "vnr,t-p;flokkur,t\na1;ostur\na2;mjolk\na3;ostur\na4;smjor\na5;mjolk\na6;ostur";
+        let mut t = ColumnTable::from_csv_string(input, "test", "test").unwrap();
+        assert!(matches!(t.table[1], DbVec::DictTexts { .. }));
+        assert!(matches!(t.table[0], DbVec::Texts { .. }));
+        assert_eq!(t.to_string(), input);
+
+        // Equality lookups run on the codes, with and without a secondary index.
+        assert_eq!(t.query_secondary("flokkur", "ostur").unwrap().lines().count(), 3);
+        t.add_secondary_index("flokkur").unwrap();
+        assert_eq!(t.query_secondary("flokkur", "ostur").unwrap().lines().count(), 3);
+        assert_eq!(t.query_secondary("flokkur", "skyr").unwrap(), "");
+
+        // An update that brings a new category extends the dictionary and keeps the
+        // column encoded; the rows land merged in primary key order.
+        t.update_from_csv("vnr,t-p;flokkur,t\na0;skyr\na3;skyr").unwrap();
+        assert!(matches!(t.table[1], DbVec::DictTexts { .. }));
+        assert_eq!(t.query_secondary("flokkur", "skyr").unwrap().lines().count(), 2);
+        assert_eq!(t.query("a3").unwrap(), "a3;skyr");
+        assert_eq!(t.len(), 7);
+
+        // The binary format carries plain text cells, so a round trip re-encodes.
+        let t2 = ColumnTable::from_binary(&t.to_binary(), "test", "test").unwrap();
+        assert!(matches!(t2.table[1], DbVec::DictTexts { .. }));
+        assert_eq!(t.to_string(), t2.to_string());
+    }
+
+    #[test]
+    fn test_dict_encoding_skips_high_cardinality() {
+        let mut input = String::from("vnr,i-p;heiti,t\n");
+        for i in 0..300 {
+            input.push_str(&format!("{i};heiti{i}\n"));
+        }
+        let t = ColumnTable::from_csv_string(input.trim(), "test", "test").unwrap();
+        assert!(matches!(t.table[1], DbVec::Texts { .. }));
+    }
+
+    #[test]
+    fn test_parallel_load_sort_and_merge() {
+        // Enough rows to cross PARALLEL_ROW_THRESHOLD so the threaded paths run; the keys
+        // descend so sort() has real work to do.
+        let rows = PARALLEL_ROW_THRESHOLD + 100;
+        let mut csv = String::from("vnr,i-p;heiti,t;magn,i\n");
+        for i in (0..rows).rev() {
+            csv.push_str(&format!("{i};heiti{};{i}\n", i % 7));
+        }
+        let mut t = ColumnTable::from_csv_string(csv.trim(), "test", "test").unwrap();
+        assert_eq!(t.len(), rows);
+        assert_eq!(t.query("0").unwrap(), "0;heiti0;0");
+        assert_eq!(t.query(&(rows-1).to_string()).unwrap(), format!("{0};heiti{1};{0}", rows-1, (rows-1) % 7));
+
+        // A delta of the same size exercises the parallel merge; overwritten keys take
+        // the delta's values.
+        let mut delta = String::from("vnr,i-p;heiti,t;magn,i\n");
+        for i in 0..rows {
+            delta.push_str(&format!("{i};breytt{};{i}\n", i % 7));
+        }
+        t.update_from_csv(delta.trim()).unwrap();
+        assert_eq!(t.len(), rows);
+        assert_eq!(t.query("17").unwrap(), "17;breytt3;17");
+    }
+
+    #[test]
+    fn test_streaming_binary_parser_matches_from_binary() {
+        let input = "vnr,i-p;heiti,t;magn,i;lengd,f\n113035;undirlegg;200;1.5\n113050;annad undirlegg;500;3.5";
+        let t = ColumnTable::from_csv_string(input, "test", "test").unwrap();
+        let bin = t.to_binary();
+        let mut parser = StreamingBinaryParser::new();
+        let mut columns_seen = 0;
+        for chunk in bin.chunks(7) {
+            parser.feed(chunk, |_column| columns_seen += 1).unwrap();
+        }
+        assert_eq!(columns_seen, t.header.len());
+        let t2 = parser.finish("test", "test").unwrap();
+        assert_eq!(t.to_string(), t2.to_string());
+
+        let mut truncated_parser = StreamingBinaryParser::new();
+        truncated_parser.feed(&bin[0..bin.len()-4], |_| ()).unwrap();
+        assert!(truncated_parser.finish("test", "test").is_err());
+    }
+
     #[test]
     fn test_columntable_combine_sorted() {
         let mut i = 0;
@@ -1217,7 +2730,134 @@ mod tests {
         let t = ColumnTable::from_csv_string(input, "test", "test").unwrap();
         let x = t.query_range(("113035", "113060")).unwrap();
 
-        assert_eq!(x, "113035;undirlegg;200\n113050;annad undirlegg;500")
+        assert_eq!(x, "113035;undirlegg;200\n113050;annad undirlegg;500");
+
+        // A range entirely below the smallest key must not leak row 0.
+        let mut t = t;
+        assert_eq!(t.query_range(("1", "3")).unwrap(), "");
+        assert_eq!(t.aggregate_query("SUM", "magn", Some(("1", "3"))), Err(StrictError::Empty));
+        assert_eq!(t.delete_range(("1", "3")).unwrap(), 0);
+    }
+
+    #[test]
+    fn test_columntable_delete_and_compact() {
+        let input = "vnr,i-p;heiti,t;magn,i\n113035;undirlegg;200\n113050;annad undirlegg;500\n113446;harlech;250\n18572054;flísalím;42";
+        let mut t = ColumnTable::from_csv_string(input, "test", "test").unwrap();
+
+        // Tombstoned rows disappear from queries and renderings but stay in the columns.
+        assert_eq!(t.delete_list(Vec::from(["113050", "999999"])).unwrap(), 1);
+        assert_eq!(t.tombstone_count(), 1);
+        assert_eq!(t.len(), 4);
+        assert_eq!(t.query("113050").unwrap(), "");
+        assert_eq!(t.query_range(("113035", "113060")).unwrap(), "113035;undirlegg;200");
+        assert_eq!(t.to_string(), "vnr,i-p;heiti,t;magn,i\n113035;undirlegg;200\n113446;harlech;250\n18572054;flísalím;42");
+        assert_eq!(t.aggregate_query("SUM", "magn", None).unwrap(), "492");
+
+        // Re-inserting a deleted key through update resurrects the row.
+        t.update_from_csv("vnr,i-p;heiti,t;magn,i\n113050;annad undirlegg;300").unwrap();
+        assert_eq!(t.query("113050").unwrap(), "113050;annad undirlegg;300");
+
+        // Compaction physically removes the dead rows and keeps everything else intact.
+        assert_eq!(t.delete_range(("113035", "113050")).unwrap(), 2);
+        let before = t.to_string();
+        assert_eq!(t.compact(), 2);
+        assert_eq!(t.len(), 2);
+        assert_eq!(t.tombstone_count(), 0);
+        assert_eq!(t.to_string(), before);
+
+        // A round trip through the binary format must drop tombstoned rows too.
+        t.update_from_csv("vnr,i-p;heiti,t;magn,i\n113035;undirlegg;200").unwrap();
+        t.delete_list(Vec::from(["113035"])).unwrap();
+        let b = ColumnTable::from_binary(&t.to_binary(), "test", "test").unwrap();
+        assert_eq!(b.to_string(), t.to_string());
+    }
+
+    #[test]
+    fn test_columntable_projected_queries() {
+        let input = "vnr,i-p;heiti,t;magn,i\n113035;undirlegg;200\n113050;annad undirlegg;500\n18572054;flísalím;42\n113446;harlech;250";
+        let t = ColumnTable::from_csv_string(input, "test", "test").unwrap();
+
+        let projection = t.projection_indexes("vnr,magn").unwrap();
+        let x = t.query_list_projected(Vec::from(["113035"]), Some(&projection)).unwrap();
+        assert_eq!(x, "113035;200");
+
+        let x = t.query_range_projected(("113035", "113060"), Some(&projection)).unwrap();
+        assert_eq!(x, "113035;200\n113050;500");
+
+        let x = t.query_secondary_projected("heiti", "harlech", Some(&projection)).unwrap();
+        assert_eq!(x, "113446;250");
+
+        assert!(t.projection_indexes("vnr,no_such_column").is_err());
+    }
+
+    #[test]
+    fn test_columntable_aggregate_query() {
+        let input = "vnr,i-p;heiti,t;magn,i\n113035;undirlegg;200\n113050;annad undirlegg;500\n18572054;flísalím;42\n113446;harlech;250";
+        let t = ColumnTable::from_csv_string(input, "test", "test").unwrap();
+
+        assert_eq!(t.aggregate_query("SUM", "magn", None).unwrap(), "992");
+        assert_eq!(t.aggregate_query("MIN", "magn", None).unwrap(), "42");
+        assert_eq!(t.aggregate_query("MAX", "magn", None).unwrap(), "500");
+        assert_eq!(t.aggregate_query("AVG", "magn", None).unwrap(), "248");
+        assert_eq!(t.aggregate_query("COUNT", "heiti", None).unwrap(), "4");
+
+        assert_eq!(t.aggregate_query("SUM", "magn", Some(("113035", "113060"))).unwrap(), "700");
+        assert_eq!(t.aggregate_query("COUNT", "magn", Some(("113035", ""))).unwrap(), "4");
+
+        assert!(t.aggregate_query("SUM", "heiti", None).is_err());
+        assert!(t.aggregate_query("SUM", "no_such_column", None).is_err());
+    }
+
+    #[test]
+    fn test_columntable_update_append_and_overwrite() {
+        let input = "vnr,i-p;heiti,t;magn,i\n113035;undirlegg;200\n113050;annad undirlegg;500";
+        let mut t = ColumnTable::from_csv_string(input, "test", "test").unwrap();
+
+        // Keys above the current maximum take the append fast path.
+        t.update_from_csv("vnr,i-p;heiti,t;magn,i\n113060;harlech;250").unwrap();
+        assert_eq!(t.to_string(), "vnr,i-p;heiti,t;magn,i\n113035;undirlegg;200\n113050;annad undirlegg;500\n113060;harlech;250");
+
+        // An overlapping delta overwrites the existing row and merges the rest in order.
+        t.update_from_csv("vnr,i-p;heiti,t;magn,i\n113040;flísalím;42\n113050;annad undirlegg;400").unwrap();
+        assert_eq!(t.to_string(), "vnr,i-p;heiti,t;magn,i\n113035;undirlegg;200\n113040;flísalím;42\n113050;annad undirlegg;400\n113060;harlech;250");
+
+        // A second merge reuses the scratch buffers and must behave the same.
+        t.update_from_csv("vnr,i-p;heiti,t;magn,i\n113030;skrúfa;10").unwrap();
+        assert_eq!(t.to_string(), "vnr,i-p;heiti,t;magn,i\n113030;skrúfa;10\n113035;undirlegg;200\n113040;flísalím;42\n113050;annad undirlegg;400\n113060;harlech;250");
+    }
+
+    #[test]
+    fn test_apply_permutation_in_place() {
+        let mut col = vec!["d", "b", "a", "c"];
+        let mut scratch = vec![2, 1, 3, 0];
+        apply_permutation_in_place(&mut col, &mut scratch);
+        assert_eq!(col, vec!["a", "b", "c", "d"]);
+
+        // An already sorted permutation must leave the column untouched.
+        let mut col = vec![1, 2, 3];
+        let mut scratch = vec![0, 1, 2];
+        apply_permutation_in_place(&mut col, &mut scratch);
+        assert_eq!(col, vec![1, 2, 3]);
+    }
+
+    #[test]
+    fn test_columntable_secondary_index() {
+        let input = "vnr,i-p;heiti,t;magn,i\n113035;undirlegg;200\n113050;annad undirlegg;500\n18572054;flísalím;42\n113446;undirlegg;250";
+        let mut t = ColumnTable::from_csv_string(input, "test", "test").unwrap();
+
+        // The linear scan fallback and the indexed lookup must agree.
+        let scanned = t.query_secondary("heiti", "undirlegg").unwrap();
+        t.add_secondary_index("heiti").unwrap();
+        let indexed = t.query_secondary("heiti", "undirlegg").unwrap();
+        assert_eq!(scanned, indexed);
+        assert_eq!(indexed, "113035;undirlegg;200\n113446;undirlegg;250");
+
+        // The index has to survive an update that re-sorts the rows.
+        t.update_from_csv("vnr,i-p;heiti,t;magn,i\n113010;undirlegg;100").unwrap();
+        let x = t.query_secondary("heiti", "undirlegg").unwrap();
+        assert_eq!(x, "113010;undirlegg;100\n113035;undirlegg;200\n113446;undirlegg;250");
+
+        assert!(t.add_secondary_index("no_such_column").is_err());
     }
 
 
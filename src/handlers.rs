@@ -1,33 +1,171 @@
-use std::{sync::{Arc, Mutex}, collections::HashMap, io::Write};
+use std::{sync::{Arc, Mutex, RwLock}, collections::HashMap, hash::Hasher, io::Write};
 
-use crate::{networking_utilities::*, db_structure::{ColumnTable, Value}, auth::User};
+use crate::{networking_utilities::*, db_structure::{ColumnTable, Metadata, StrictError, Value}, auth::{user_has_permission, AuthenticationError, User}, server_networking::{get_or_load_table, TableLoadCoordinator, Wal, CONFIG_FOLDER, TABLE_CATALOG, WAL_OP_UPDATE, WAL_OP_KV_UPDATE, WAL_OP_DELETE}};
+use crate::debug_println;
 
+use fnv::FnvHasher;
 use smartstring::{SmartString, LazyCompact};
 
 pub type KeyString = SmartString<LazyCompact>;
 
+/// The table catalog. The outer RwLock only guards the map itself and is held just long
+/// enough to look a table up or insert one. Each table carries its own RwLock so reads
+/// of different tables (and read-only queries of the same table) run in parallel.
+pub type GlobalTables = Arc<RwLock<HashMap<KeyString, Arc<RwLock<ColumnTable>>>>>;
+
+/// How many independent locks the KV store is split across. Operations on different keys
+/// hash to different shards and never contend with each other.
+pub const KV_SHARD_COUNT: usize = 16;
+
+/// Bodies of at least this many bytes are not kept resident. They are written to
+/// EZconfig/key_value when they are inserted (the same file the save loop would write
+/// anyway) and streamed from disk on download.
+pub const KV_SPILL_THRESHOLD: usize = 10_000_000;
+
+/// One entry of the KV store. Resident values sit behind an Arc so a download can clone
+/// the handle, drop the shard lock, and send the body without blocking the shard.
+#[derive(Clone, Debug)]
+pub enum KvEntry {
+    Resident(Arc<Value>),
+    Spilled { metadata: Metadata, size: usize },
+}
+
+impl KvEntry {
+    pub fn metadata(&self) -> &Metadata {
+        match self {
+            KvEntry::Resident(value) => &value.metadata,
+            KvEntry::Spilled { metadata, size: _ } => metadata,
+        }
+    }
+}
+
+/// The KV store, sharded by fnv hash of the key so one client pulling a huge value never
+/// blocks KV operations on other keys.
+pub struct KvStore {
+    shards: Vec<Mutex<HashMap<KeyString, KvEntry>>>,
+}
+
+pub type GlobalKv = Arc<KvStore>;
+
+impl KvStore {
+
+    pub fn new() -> KvStore {
+        let mut shards = Vec::with_capacity(KV_SHARD_COUNT);
+        for _ in 0..KV_SHARD_COUNT {
+            shards.push(Mutex::new(HashMap::new()));
+        }
+        KvStore {
+            shards: shards,
+        }
+    }
+
+    fn shard(&self, key: &str) -> &Mutex<HashMap<KeyString, KvEntry>> {
+        let mut hasher = FnvHasher::default();
+        hasher.write(key.as_bytes());
+        &self.shards[hasher.finish() as usize % KV_SHARD_COUNT]
+    }
 
+    pub fn contains_key(&self, key: &str) -> bool {
+        self.shard(key).lock().unwrap().contains_key(key)
+    }
 
+    /// Clones the entry handle out of the shard. For a resident value that is an Arc
+    /// clone, so the caller can stream even a big body without holding any lock.
+    pub fn get(&self, key: &str) -> Option<KvEntry> {
+        self.shard(key).lock().unwrap().get(key).cloned()
+    }
 
+    /// Inserts a value, carrying the mutation counter over from any old entry so the save
+    /// loop sees the change. Bodies of KV_SPILL_THRESHOLD bytes or more go straight to
+    /// disk and only their metadata stays resident. The disk write happens before the
+    /// shard lock is taken so a slow disk never blocks the shard.
+    pub fn insert(&self, key: &str, mut value: Value) -> Result<(), StrictError> {
+        if let Some(old_entry) = self.get(key) {
+            value.metadata.times_modified = old_entry.metadata().times_modified + 1;
+        }
+        let entry = if value.body.len() >= KV_SPILL_THRESHOLD {
+            value.save_to_disk_raw(key, CONFIG_FOLDER)?;
+            KvEntry::Spilled { metadata: value.metadata.clone(), size: value.body.len() }
+        } else {
+            KvEntry::Resident(Arc::new(value))
+        };
+        self.shard(key).lock().unwrap().insert(KeyString::from(key), entry);
+        Ok(())
+    }
 
-pub fn handle_download_request(mut connection: &mut Connection, name: &str, global_tables: Arc<Mutex<HashMap<KeyString, ColumnTable>>>) -> Result<(), ServerError> {
+    /// Bumps the access metadata of an entry after a successful download.
+    pub fn touch(&self, key: &str) {
+        let mut shard_lock = self.shard(key).lock().unwrap();
+        if let Some(entry) = shard_lock.get_mut(key) {
+            match entry {
+                KvEntry::Resident(value) => {
+                    // Resident bodies are under the spill threshold, so the clone
+                    // make_mut does while a download still holds the old Arc is small.
+                    let value = Arc::make_mut(value);
+                    value.metadata.last_access = get_current_time();
+                    value.metadata.times_accessed += 1;
+                },
+                KvEntry::Spilled { metadata, size: _ } => {
+                    metadata.last_access = get_current_time();
+                    metadata.times_accessed += 1;
+                },
+            }
+        }
+    }
+
+    pub fn keys(&self) -> Vec<KeyString> {
+        let mut keys = Vec::new();
+        for shard in self.shards.iter() {
+            for key in shard.lock().unwrap().keys() {
+                keys.push(key.clone());
+            }
+        }
+        keys
+    }
+
+    /// The resident values, for the save loop's checkpoint pass. Spilled entries were
+    /// written to disk when they were inserted and need no checkpoint.
+    pub fn resident_values(&self) -> Vec<(KeyString, Arc<Value>)> {
+        let mut values = Vec::new();
+        for shard in self.shards.iter() {
+            for (key, entry) in shard.lock().unwrap().iter() {
+                if let KvEntry::Resident(value) = entry {
+                    values.push((key.clone(), value.clone()));
+                }
+            }
+        }
+        values
+    }
+}
+
+
+
+
+
+pub fn handle_download_request(mut connection: &mut Connection, name: &str, global_tables: GlobalTables, table_loading: &TableLoadCoordinator) -> Result<(), ServerError> {
     match connection.stream.write("OK".as_bytes()) {
-        Ok(n) => println!("Wrote {n} bytes"),
+        Ok(n) => debug_println!("Wrote {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));},
     };
 
-    let mut mutex_binding = global_tables.lock().unwrap();
-    let requested_table = mutex_binding.get_mut(name).expect("Instruction parser should have verified table");
-    let requested_csv = requested_table.to_string();
-    println!("Requested_csv.len(): {}", requested_csv.len());
+    // parse_instruction verified the table, but an eviction pass may have dropped it from
+    // the map since; get_or_load_table pulls it back in instead of trusting that check.
+    let requested_table = match get_or_load_table(&global_tables, table_loading, name)? {
+        Some(table) => table,
+        None => return Err(ServerError::Instruction(InstructionError::InvalidTable(name.to_owned()))),
+    };
 
-    let response = data_send_and_confirm(connection, requested_csv.as_bytes())?;
+    let requested_binary = requested_table.read().unwrap().to_binary();
+    debug_println!("Requested_binary.len(): {}", requested_binary.len());
+
+    let response = data_send_and_confirm(connection, &requested_binary)?;
 
     if response == "OK" {
-        requested_table.metadata.last_access = get_current_time();
+        let mut table_lock = requested_table.write().unwrap();
+        table_lock.metadata.last_access = get_current_time();
 
-        requested_table.metadata.times_accessed += 1;
-        println!("metadata: {}", requested_table.metadata);
+        table_lock.metadata.times_accessed += 1;
+        debug_println!("metadata: {}", table_lock.metadata);
 
         return Ok(())
     } else {
@@ -37,44 +175,45 @@ pub fn handle_download_request(mut connection: &mut Connection, name: &str, glob
 }
 
 
-pub fn handle_upload_request(mut connection: &mut Connection, name: &str, global_tables: Arc<Mutex<HashMap<KeyString, ColumnTable>>>) -> Result<String, ServerError> {
+pub fn handle_upload_request(mut connection: &mut Connection, name: &str, global_tables: GlobalTables) -> Result<String, ServerError> {
 
     match connection.stream.write("OK".as_bytes()) {
-        Ok(n) => println!("Wrote OK as {n} bytes"),
+        Ok(n) => debug_println!("Wrote OK as {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));},
     };
     connection.stream.flush()?;
 
 
-    let (csv, total_read) = receive_data(connection)?;
+    let (binary, total_read) = receive_data(connection)?;
 
-    // Here we create a ColumnTable from the csv and supplied name
-    println!("About to check for strictness");
+    // Here we create a ColumnTable from the binary payload and supplied name
+    debug_println!("About to check for strictness");
     let instant = std::time::Instant::now();
-    match ColumnTable::from_csv_string(bytes_to_str(&csv)?, name, "test") {
+    match ColumnTable::from_binary(&binary, name, "test") {
         Ok(mut table) => {
-            println!("About to write: {:x?}", format!("{}", total_read).as_bytes());
-            println!("Which is: {}", bytes_to_str(format!("{}", total_read).as_bytes())?);
+            debug_println!("About to write: {:x?}", format!("{}", total_read).as_bytes());
+            debug_println!("Which is: {}", bytes_to_str(format!("{}", total_read).as_bytes())?);
             match connection.stream.write(format!("{}", total_read).as_bytes()) {
                 Ok(_) => {
-                    println!("Time to check strictness: {}", instant.elapsed().as_millis());
-                    println!("Confirmed correctness with client");
+                    debug_println!("Time to check strictness: {}", instant.elapsed().as_millis());
+                    debug_println!("Confirmed correctness with client");
                 },
                 Err(e) => {return Err(ServerError::Io(e.kind()));},
             };
 
-            println!("Appending to global");
-            println!("{:?}", &table.header);
+            debug_println!("Appending to global");
+            debug_println!("{:?}", &table.header);
             table.metadata.last_access = get_current_time();
             table.metadata.created_by = KeyString::from(connection.user.clone());
         
             table.metadata.times_accessed += 1;
             
-            global_tables.lock().unwrap().insert(KeyString::from(table.name.clone()), table);
+            TABLE_CATALOG.add_table(&table.name);
+            global_tables.write().unwrap().insert(KeyString::from(table.name.clone()), Arc::new(RwLock::new(table)));
 
         },
         Err(e) => match connection.stream.write(e.to_string().as_bytes()){
-            Ok(_) => println!("Informed client of unstrictness"),
+            Ok(_) => debug_println!("Informed client of unstrictness"),
             Err(e) => {return Err(ServerError::Io(e.kind()));},
         },
     };
@@ -84,10 +223,10 @@ pub fn handle_upload_request(mut connection: &mut Connection, name: &str, global
 }
     
     
-pub fn handle_update_request(mut connection: &mut Connection, name: &str, global_tables: Arc<Mutex<HashMap<KeyString, ColumnTable>>>) -> Result<String, ServerError> {
-    
+pub fn handle_update_request(mut connection: &mut Connection, name: &str, global_tables: GlobalTables, wal: Arc<Mutex<Wal>>, table_loading: &TableLoadCoordinator) -> Result<String, ServerError> {
+
     match connection.stream.write("OK".as_bytes()) {
-        Ok(n) => println!("Wrote {n} bytes"),
+        Ok(n) => debug_println!("Wrote {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));},
     };
     connection.stream.flush()?;
@@ -95,11 +234,16 @@ pub fn handle_update_request(mut connection: &mut Connection, name: &str, global
 
     let (csv, total_read) = receive_data(connection)?;
 
-    let mut mutex_binding = global_tables.lock().unwrap();
+    // Logged before it is applied so an accepted update survives a crash.
+    wal.lock().unwrap().append(WAL_OP_UPDATE, name, &csv)?;
 
-    let requested_table = mutex_binding.get_mut(name).expect("Instruction parser should have verified existence of table");
-    
-    match requested_table.update_from_csv(bytes_to_str(&csv)?) {
+    // The table may have been evicted between parse_instruction's check and now.
+    let requested_table = match get_or_load_table(&global_tables, table_loading, name)? {
+        Some(table) => table,
+        None => return Err(ServerError::Instruction(InstructionError::InvalidTable(name.to_owned()))),
+    };
+
+    match requested_table.write().unwrap().update_from_csv(bytes_to_str(&csv)?) {
         Ok(_) => {
             connection.stream.write_all(total_read.to_string().as_bytes())?;
         },
@@ -113,35 +257,239 @@ pub fn handle_update_request(mut connection: &mut Connection, name: &str, global
 }
 
 
-pub fn handle_query_request(mut connection: &mut Connection, name: &str, query: &str, global_tables: Arc<Mutex<HashMap<KeyString, ColumnTable>>>) -> Result<String, ServerError> {
+/// Marks the rows matching a primary key list or range as deleted. The rows only get
+/// tombstone flags here; the save loop compacts the table once enough of them accumulate,
+/// so a small delete costs a few flag writes instead of a full table rewrite. The number of
+/// rows deleted is sent back to the client.
+pub fn handle_delete_request(connection: &mut Connection, name: &str, query: &str, global_tables: GlobalTables, wal: Arc<Mutex<Wal>>, table_loading: &TableLoadCoordinator) -> Result<String, ServerError> {
     match connection.stream.write("OK".as_bytes()) {
-        Ok(n) => println!("Wrote {n} bytes"),
+        Ok(n) => debug_println!("Wrote {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));},
     };
     connection.stream.flush()?;
 
+    // Logged before it is applied so an accepted delete survives a crash.
+    wal.lock().unwrap().append(WAL_OP_DELETE, name, query.as_bytes())?;
 
-    
-    let mutex_binding = global_tables.lock().unwrap();
-    let requested_table = mutex_binding.get(name).expect("Instruction parser should have verified table");
-    // PARSE INSTRUCTION
-    let query_type: &str;
-    match query.find("..") {
-        Some(_) => query_type = "range",
-        None => query_type = "list"
+    // The table may have been evicted between parse_instruction's check and now.
+    let requested_table = match get_or_load_table(&global_tables, table_loading, name)? {
+        Some(table) => table,
+        None => return Err(ServerError::Instruction(InstructionError::InvalidTable(name.to_owned()))),
     };
-    
-    let requested_csv: String;
-    if query_type == "range" {
+
+    let deleted = if query.find("..").is_some() {
         let parsed_query: Vec<&str> = query.split("..").collect();
-        requested_csv = requested_table.query_range((parsed_query[0], parsed_query[1]))?;
+        requested_table.write().unwrap().delete_range((parsed_query[0], parsed_query[1]))?
+    } else {
+        requested_table.write().unwrap().delete_list(query.split(',').collect())?
+    };
+
+    let response = data_send_and_confirm(connection, deleted.to_string().as_bytes())?;
+
+    if response == "OK" {
+        return Ok("OK".to_owned())
+    } else {
+        return Err(ServerError::Confirmation(response))
+    }
+}
+
+
+/// Checks whether a query string is an aggregate like SUM(price) or AVG(price);0113000..0113060.
+/// Returns the function name, the column name, and the optional primary key range, or None
+/// if the query should be treated as a regular list or range query.
+pub fn parse_aggregate_query(query: &str) -> Option<(&str, &str, Option<(&str, &str)>)> {
+    for function in ["SUM", "MIN", "MAX", "AVG", "COUNT"] {
+        if query.starts_with(function) && query[function.len()..].starts_with('(') {
+            let close = match query.find(')') {
+                Some(index) => index,
+                None => return None,
+            };
+            let column = &query[function.len()+1..close];
+            let rest = &query[close+1..];
+            if rest == "" {
+                return Some((function, column, None));
+            } else if rest.starts_with(';') && rest.find("..").is_some() {
+                let parsed_range: Vec<&str> = rest[1..].split("..").collect();
+                return Some((function, column, Some((parsed_range[0], parsed_range[1]))));
+            } else {
+                return None;
+            }
+        }
+    }
+    None
+}
+
+/// Runs one query string against a table and returns the result csv. Shared between the
+/// single-query handler and batch execution.
+/// Aggregate queries look like SUM(price) or SUM(price);0113000..0113060 and return a
+/// single number instead of csv rows, so reporting jobs never download the whole table.
+/// INDEX(column) builds a secondary index and column=value searches by any column.
+/// A SELECT(col1,col2); prefix restricts the output to the named columns.
+pub fn execute_query(requested_table: &Arc<RwLock<ColumnTable>>, query: &str) -> Result<String, ServerError> {
+
+    let requested_csv: String;
+    if query.starts_with("INDEX(") && query.ends_with(')') {
+        let column = &query["INDEX(".len()..query.len()-1];
+        requested_table.write().unwrap().add_secondary_index(column)?;
+        requested_csv = "OK".to_owned();
     } else {
-        let parsed_query = query.split(',').collect();
-        requested_csv = requested_table.query_list(parsed_query)?;
+        let (projected_columns, query) = match query.strip_prefix("SELECT(") {
+            Some(rest) => match rest.find(");") {
+                Some(close) => (Some(&rest[..close]), &rest[close+2..]),
+                None => (None, query),
+            },
+            None => (None, query),
+        };
+
+        let table_lock = requested_table.read().unwrap();
+        let projection = match projected_columns {
+            Some(columns) => Some(table_lock.projection_indexes(columns)?),
+            None => None,
+        };
+        let projection = projection.as_deref();
+
+        if let Some(aggregate) = parse_aggregate_query(query) {
+            let (function, column, range) = aggregate;
+            requested_csv = table_lock.aggregate_query(function, column, range)?;
+        } else if query.find("..").is_some() {
+            let parsed_query: Vec<&str> = query.split("..").collect();
+            requested_csv = table_lock.query_range_projected((parsed_query[0], parsed_query[1]), projection)?;
+        } else if query.find('=').is_some() {
+            let parsed_query: Vec<&str> = query.split('=').collect();
+            requested_csv = table_lock.query_secondary_projected(parsed_query[0], parsed_query[1], projection)?;
+        } else {
+            let parsed_query = query.split(',').collect();
+            requested_csv = table_lock.query_list_projected(parsed_query, projection)?;
+        }
+    }
+
+    // Queries count as accesses too, so a hot table does not look cold to the eviction pass.
+    {
+        let mut table_lock = requested_table.write().unwrap();
+        table_lock.metadata.last_access = get_current_time();
+        table_lock.metadata.times_accessed += 1;
     }
 
+    Ok(requested_csv)
+}
+
+pub fn handle_query_request(mut connection: &mut Connection, name: &str, query: &str, global_tables: GlobalTables, table_loading: &TableLoadCoordinator) -> Result<String, ServerError> {
+    match connection.stream.write("OK".as_bytes()) {
+        Ok(n) => debug_println!("Wrote {n} bytes"),
+        Err(e) => {return Err(ServerError::Io(e.kind()));},
+    };
+    connection.stream.flush()?;
+
+
+    // The table may have been evicted between parse_instruction's check and now.
+    let requested_table = match get_or_load_table(&global_tables, table_loading, name)? {
+        Some(table) => table,
+        None => return Err(ServerError::Instruction(InstructionError::InvalidTable(name.to_owned()))),
+    };
+
+    let requested_csv = execute_query(&requested_table, query)?;
+
     let response = data_send_and_confirm(connection, requested_csv.as_bytes())?;
-    
+
+    if response == "OK" {
+        return Ok("OK".to_owned())
+    } else {
+        return Err(ServerError::Confirmation(response))
+    }
+}
+
+
+/// Looks a table up for a batch operation, remembering the handle so later operations on
+/// the same table skip the catalog and the load coordinator entirely.
+fn batch_table_handle(name: &str, global_tables: &GlobalTables, table_loading: &TableLoadCoordinator, table_handles: &mut HashMap<KeyString, Arc<RwLock<ColumnTable>>>) -> Result<Arc<RwLock<ColumnTable>>, ServerError> {
+    if let Some(table) = table_handles.get(name) {
+        return Ok(table.clone());
+    }
+    match get_or_load_table(global_tables, table_loading, name)? {
+        Some(table) => {
+            table_handles.insert(KeyString::from(name), table.clone());
+            Ok(table)
+        },
+        None => Err(ServerError::Instruction(InstructionError::InvalidTable(name.to_owned()))),
+    }
+}
+
+/// Runs one operation of a batch. The checks mirror what parse_instruction does for the
+/// equivalent single instruction, so an operation behaves the same whether it is batched
+/// or sent on its own.
+fn execute_batch_op(op: BatchOp, connection: &Connection, users: &Arc<Mutex<HashMap<KeyString, User>>>, global_tables: &GlobalTables, global_kv_table: &GlobalKv, wal: &Arc<Mutex<Wal>>, table_loading: &TableLoadCoordinator, table_handles: &mut HashMap<KeyString, Arc<RwLock<ColumnTable>>>) -> Result<String, ServerError> {
+    match op {
+        BatchOp::Update(name, csv) => {
+            let table = batch_table_handle(&name, global_tables, table_loading, table_handles)?;
+            // Logged before it is applied so an accepted update survives a crash.
+            wal.lock().unwrap().append(WAL_OP_UPDATE, &name, csv.as_bytes())?;
+            table.write().unwrap().update_from_csv(&csv)?;
+            Ok("OK".to_owned())
+        },
+        BatchOp::Query(name, query) => {
+            let table = batch_table_handle(&name, global_tables, table_loading, table_handles)?;
+            if user_has_permission(&name, "Querying", &connection.user, users.clone()) {
+                execute_query(&table, &query)
+            } else {
+                Err(ServerError::Authentication(AuthenticationError::Permission))
+            }
+        },
+        BatchOp::Delete(name, query) => {
+            let table = batch_table_handle(&name, global_tables, table_loading, table_handles)?;
+            wal.lock().unwrap().append(WAL_OP_DELETE, &name, query.as_bytes())?;
+            let deleted = if query.find("..").is_some() {
+                let parsed_query: Vec<&str> = query.split("..").collect();
+                table.write().unwrap().delete_range((parsed_query[0], parsed_query[1]))?
+            } else {
+                table.write().unwrap().delete_list(query.split(',').collect())?
+            };
+            Ok(deleted.to_string())
+        },
+        BatchOp::KvUpdate(key, value) => {
+            if !global_kv_table.contains_key(&key) {
+                return Err(ServerError::Instruction(InstructionError::InvalidTable(format!("Entry '{}' does not exist. Use 'upload' instead", key))));
+            }
+            wal.lock().unwrap().append(WAL_OP_KV_UPDATE, &key, &value)?;
+            let value = Value::new(&connection.user, &value);
+            global_kv_table.insert(&key, value)?;
+            Ok("OK".to_owned())
+        },
+    }
+}
+
+/// Executes a whole list of operations received as one framed message and sends one
+/// combined response back, so an ingest job touching 40 tables pays one round trip
+/// instead of 40. Operations run in order and each distinct table is looked up once. A
+/// failed operation reports its error in its slot of the response and the rest still run.
+pub fn handle_batch(connection: &mut Connection, users: Arc<Mutex<HashMap<KeyString, User>>>, global_tables: GlobalTables, global_kv_table: GlobalKv, wal: Arc<Mutex<Wal>>, table_loading: &TableLoadCoordinator) -> Result<String, ServerError> {
+
+    match connection.stream.write("OK".as_bytes()) {
+        Ok(n) => debug_println!("Wrote {n} bytes"),
+        Err(e) => {return Err(ServerError::Io(e.kind()));},
+    };
+    connection.stream.flush()?;
+
+    let (data, total_read) = receive_data(connection)?;
+    let ops = parse_batch(&data)?;
+    debug_println!("Executing batch of {} operations", ops.len());
+
+    // The length echo confirms the transfer; the per-operation results follow as their
+    // own framed message once the batch has run.
+    connection.stream.write_all(total_read.to_string().as_bytes())?;
+    connection.stream.flush()?;
+
+    let mut table_handles: HashMap<KeyString, Arc<RwLock<ColumnTable>>> = HashMap::new();
+    let mut responses: Vec<String> = Vec::with_capacity(ops.len());
+    for op in ops {
+        let result = execute_batch_op(op, connection, &users, &global_tables, &global_kv_table, &wal, table_loading, &mut table_handles);
+        responses.push(match result {
+            Ok(response) => response,
+            Err(e) => format!("ERROR: {}", e),
+        });
+    }
+
+    let response = data_send_and_confirm(connection, &serialize_batch_responses(&responses))?;
+
     if response == "OK" {
         return Ok("OK".to_owned())
     } else {
@@ -162,10 +510,10 @@ pub fn handle_new_user_request(user_string: &str, users: Arc<Mutex<HashMap<KeySt
 
 }
 
-pub fn handle_kv_upload(mut connection: &mut Connection, name: &str, global_kv_table: Arc<Mutex<HashMap<KeyString, Value>>>) -> Result<(), ServerError> {
+pub fn handle_kv_upload(mut connection: &mut Connection, name: &str, global_kv_table: GlobalKv) -> Result<(), ServerError> {
 
     match connection.stream.write("OK".as_bytes()) {
-        Ok(n) => println!("Wrote OK as {n} bytes"),
+        Ok(n) => debug_println!("Wrote OK as {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));},
     };
     connection.stream.flush()?;
@@ -175,31 +523,30 @@ pub fn handle_kv_upload(mut connection: &mut Connection, name: &str, global_kv_t
     // println!("value: {:?}", value);
 
     // Here we create a ColumnTable from the csv and supplied name
-    println!("About to check for strictness");
+    debug_println!("About to check for strictness");
     match connection.stream.write(format!("{}", total_read).as_bytes()) {
         Ok(_) => {
-            println!("Confirmed correctness with client");
+            debug_println!("Confirmed correctness with client");
         },
         Err(e) => {return Err(ServerError::Io(e.kind()));},
     };
 
-    println!("Appending to global");
-    
+    debug_println!("Appending to global");
+
     let value = Value::new(&connection.user, &value);
 
-    let mut global_kv_table_lock = global_kv_table.lock().unwrap();
-    global_kv_table_lock.insert(KeyString::from(name), value);
-    println!("value from table: {:x?}", global_kv_table_lock.get(name).unwrap().body);
+    global_kv_table.insert(name, value)?;
+    TABLE_CATALOG.add_key_value(name);
 
 
     Ok(())
 
 }
 
-pub fn handle_kv_update(mut connection: &mut Connection, name: &str, global_kv_table: Arc<Mutex<HashMap<KeyString, Value>>>) -> Result<(), ServerError> {
+pub fn handle_kv_update(mut connection: &mut Connection, name: &str, global_kv_table: GlobalKv, wal: Arc<Mutex<Wal>>) -> Result<(), ServerError> {
 
     match connection.stream.write("OK".as_bytes()) {
-        Ok(n) => println!("Wrote OK as {n} bytes"),
+        Ok(n) => debug_println!("Wrote OK as {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));},
     };
     connection.stream.flush()?;
@@ -207,46 +554,58 @@ pub fn handle_kv_update(mut connection: &mut Connection, name: &str, global_kv_t
 
     let (value, total_read) = receive_data(connection)?;
 
+    // Logged before it is applied so an accepted update survives a crash.
+    wal.lock().unwrap().append(WAL_OP_KV_UPDATE, name, &value)?;
+
     // Here we create a ColumnTable from the csv and supplied name
-    println!("About to check for strictness");
+    debug_println!("About to check for strictness");
     match connection.stream.write(format!("{}", total_read).as_bytes()) {
         Ok(_) => {
-            println!("Confirmed correctness with client");
+            debug_println!("Confirmed correctness with client");
         },
         Err(e) => {return Err(ServerError::Io(e.kind()));},
     };
 
-    println!("Appending to global");
-    
+    debug_println!("Appending to global");
+
     let value = Value::new(&connection.user, &value);
 
-    global_kv_table.lock().unwrap().insert(KeyString::from(name), value);
+    // insert() carries the mutation counter over from the old value so the save loop
+    // sees the change.
+    global_kv_table.insert(name, value)?;
 
 
     Ok(())
 }
 
-pub fn handle_kv_download(mut connection: &mut Connection, name: &str, global_kv_table: Arc<Mutex<HashMap<KeyString, Value>>>) -> Result<(), ServerError> {
+pub fn handle_kv_download(mut connection: &mut Connection, name: &str, global_kv_table: GlobalKv) -> Result<(), ServerError> {
 
     match connection.stream.write("OK".as_bytes()) {
-        Ok(n) => println!("Wrote {n} bytes"),
+        Ok(n) => debug_println!("Wrote {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));},
     };
     connection.stream.flush()?;
 
-
-    let mut mutex_binding = global_kv_table.lock().unwrap();
-    let requested_value = mutex_binding.get_mut(name).expect("Instruction parser should have verified table");
-
-    // println!("Requested_value: {:x?}", requested_value.body);
-
-    let response = data_send_and_confirm(connection, &requested_value.body)?;
+    // The entry handle is cloned out of the shard, so no lock is held while the body
+    // goes through the socket. Other KV operations, including ones on this shard,
+    // proceed during the send.
+    let requested_entry = global_kv_table.get(name).expect("Instruction parser should have verified table");
+
+    let response = match requested_entry {
+        KvEntry::Resident(value) => data_send_and_confirm(connection, &value.body)?,
+        KvEntry::Spilled { metadata: _, size } => {
+            // The body lives in EZconfig/key_value. It is streamed from disk one frame
+            // at a time so a huge blob never becomes resident.
+            let mut file = match std::fs::File::open(format!("{}key_value/{}", CONFIG_FOLDER, name)) {
+                Ok(f) => f,
+                Err(e) => return Err(ServerError::Io(e.kind())),
+            };
+            file_send_and_confirm(connection, &mut file, size)?
+        },
+    };
 
     if response == "OK" {
-        requested_value.metadata.last_access = get_current_time();
-
-        requested_value.metadata.times_accessed += 1;
-        println!("metadata: {}", requested_value.metadata.to_string());
+        global_kv_table.touch(name);
 
         return Ok(())
     } else {
@@ -255,40 +614,20 @@ pub fn handle_kv_download(mut connection: &mut Connection, name: &str, global_kv
 
 }
 
-pub fn handle_meta_list_tables(mut connection: &mut Connection, global_tables: Arc<Mutex<HashMap<KeyString, ColumnTable>>>) -> Result<(), ServerError> {
+/// Lists every table the server knows about, in memory or on disk. The names come from
+/// the in-memory catalog, so a monitoring poll costs a brief read lock instead of a
+/// directory scan while holding the table catalog lock.
+pub fn handle_meta_list_tables(mut connection: &mut Connection) -> Result<(), ServerError> {
 
     match connection.stream.write("OK".as_bytes()) {
-        Ok(n) => println!("Wrote {n} bytes"),
+        Ok(n) => debug_println!("Wrote {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));},
     };
     connection.stream.flush()?;
 
-    let mutex_binding = global_tables.lock().unwrap();
-    let mut memory_table_names: Vec<&KeyString> = mutex_binding.keys().collect();
-
-    let mut disk_table_names = Vec::new();
-    for file in std::fs::read_dir("C:\\Users\\Hallg\\Desktop\\code\\rust\\EZDB\\EZconfig\\raw_tables").unwrap() {
-        match file {
-            Ok(f) => disk_table_names.push(KeyString::from(f.file_name().into_string().unwrap())),
-            Err(e) => println!("error while reading directory entries: {e}"),
-        }
-    }
-
-    for item in disk_table_names.iter() {
-        memory_table_names.push(item);
-    }
-
-    memory_table_names.sort();
-    memory_table_names.dedup();
-
-    let mut printer = String::new();
-    for table_name in memory_table_names {
-        printer.push_str(table_name);
-        printer.push('\n');
-    }
+    let printer = TABLE_CATALOG.list_tables();
 
-
-    println!("tables_list: {}", printer);
+    debug_println!("tables_list: {}", printer);
 
     let response = data_send_and_confirm(connection, printer.as_bytes())?;
 
@@ -300,40 +639,41 @@ pub fn handle_meta_list_tables(mut connection: &mut Connection, global_tables: A
 
 }
 
-pub fn handle_meta_list_key_values(mut connection: &mut Connection, global_kv_table: Arc<Mutex<HashMap<KeyString, Value>>>) -> Result<(), ServerError> {
+/// The key-value counterpart of handle_meta_list_tables.
+pub fn handle_meta_list_key_values(mut connection: &mut Connection) -> Result<(), ServerError> {
 
     match connection.stream.write("OK".as_bytes()) {
-        Ok(n) => println!("Wrote {n} bytes"),
+        Ok(n) => debug_println!("Wrote {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));},
     };
     connection.stream.flush()?;
 
-    let mutex_binding = global_kv_table.lock().unwrap();
+    let printer = TABLE_CATALOG.list_key_values();
 
-    let mut memory_table_names: Vec<&KeyString> = mutex_binding.keys().collect();
+    debug_println!("tables_list: {}", printer);
 
-    let mut disk_table_names = Vec::new();
-    for file in std::fs::read_dir("C:\\Users\\Hallg\\Desktop\\code\\rust\\EZDB\\EZconfig\\key_value").unwrap() {
-        match file {
-            Ok(f) => disk_table_names.push(KeyString::from(f.file_name().into_string().unwrap())),
-            Err(e) => println!("error while reading directory entries: {e}"),
-        }
-    }
+    let response = data_send_and_confirm(connection, printer.as_bytes())?;
 
-    for item in disk_table_names.iter() {
-        memory_table_names.push(item);
+    if response == "OK" {
+        return Ok(())
+    } else {
+        return Err(ServerError::Confirmation(response))
     }
 
-    memory_table_names.sort();
-    memory_table_names.dedup();
+}
 
-    let mut printer = String::new();
-    for key in memory_table_names {
-        printer.push_str(key);
-        printer.push('\n');
-    }
+/// Sends the server's accumulated request statistics. The counters live in the
+/// SERVER_STATS atomics so reading them here never touches a table lock.
+pub fn handle_meta_stats(connection: &mut Connection) -> Result<(), ServerError> {
 
-    println!("tables_list: {}", printer);
+    match connection.stream.write("OK".as_bytes()) {
+        Ok(n) => debug_println!("Wrote {n} bytes"),
+        Err(e) => {return Err(ServerError::Io(e.kind()));},
+    };
+    connection.stream.flush()?;
+
+    let printer = SERVER_STATS.report();
+    debug_println!("stats: {}", printer);
 
     let response = data_send_and_confirm(connection, printer.as_bytes())?;
 
@@ -343,4 +683,4 @@ pub fn handle_meta_list_key_values(mut connection: &mut Connection, global_kv_ta
         return Err(ServerError::Confirmation(response))
     }
 
-}
\ No newline at end of file
+}
@@ -7,6 +7,6 @@ pub mod server_networking;
 pub mod client_networking;
 pub mod networking_utilities;
 pub mod auth;
-// pub mod aes;
+pub mod aes;
 pub mod aes_temp_crypto;
 pub mod handlers;
\ No newline at end of file
@@ -3,6 +3,7 @@ use std::io::{Write, Read, ErrorKind};
 use std::net::TcpStream;
 use std::num::ParseIntError;
 use std::str::{self, Utf8Error};
+use std::sync::atomic::{AtomicU64, Ordering};
 use std::time::Duration;
 use std::{usize, fmt};
 
@@ -12,6 +13,7 @@ use aes_gcm::aead;
 use crate::aes_temp_crypto::{encrypt_aes256, decrypt_aes256};
 use crate::auth::AuthenticationError;
 use crate::db_structure::StrictError;
+use crate::debug_println;
 
 
 pub const INSTRUCTION_BUFFER: usize = 1024;
@@ -19,6 +21,27 @@ pub const DATA_BUFFER: usize = 1_000_000;
 pub const INSTRUCTION_LENGTH: usize = 4;
 pub const MAX_DATA_LEN: usize = u32::MAX as usize;
 
+/// First byte a client sends after reading the server public key. Says whether the client
+/// wants a full x25519 handshake or wants to resume an earlier session from a ticket.
+pub const HANDSHAKE_FULL: u8 = 0;
+pub const HANDSHAKE_RESUME: u8 = 1;
+
+/// How many seconds an issued session ticket stays valid.
+pub const SESSION_TICKET_LIFETIME: u64 = 3600;
+
+/// The plaintext a resuming client encrypts under the ticket's aes key. Proves the client
+/// owns the key, so a sniffed ticket on its own resumes nothing.
+pub const RESUME_PROOF: &[u8] = b"resume";
+
+/// Payloads below this size go uncompressed: small query responses are latency bound and
+/// the codec overhead would eat any savings.
+pub const COMPRESSION_THRESHOLD: usize = 4096;
+
+/// Codec byte sent right after the payload length so the receiver knows how to unpack.
+/// An id per codec leaves room for a stronger one later without another format change.
+pub const COMPRESSION_NONE: u8 = 0;
+pub const COMPRESSION_LZ4: u8 = 1;
+
 
 
 #[derive(Debug)]
@@ -100,12 +123,143 @@ pub enum Instruction {
     Download(String),
     Update(String),
     Query(String /* table_name */, String /* query */),
+    Delete(String /* table_name */, String /* query */),
     NewUser(String),
     KvUpload(String),
     KvUpdate(String),
     KvDownload(String),
     MetaListTables,
     MetaListKeyValues,
+    MetaStats,
+    Batch,
+}
+
+/// One operation inside a batched request. Covers what ingest jobs pipeline; anything
+/// interactive still goes through its own instruction.
+#[derive(Debug, PartialEq, Clone)]
+pub enum BatchOp {
+    Update(String /* table_name */, String /* csv */),
+    Query(String /* table_name */, String /* query */),
+    Delete(String /* table_name */, String /* query */),
+    KvUpdate(String /* key */, Vec<u8> /* value */),
+}
+
+/// Packs a list of operations into one framed payload: a u32 operation count, then per
+/// operation a u32 header length, an "Action|table_name|query" header, a u64 payload
+/// length and the payload bytes. Same length-prefix style as the write-ahead log records.
+pub fn serialize_batch(ops: &[BatchOp]) -> Vec<u8> {
+    let mut output: Vec<u8> = Vec::new();
+    output.extend_from_slice(&(ops.len() as u32).to_le_bytes());
+    for op in ops {
+        let (header, payload): (String, &[u8]) = match op {
+            BatchOp::Update(table_name, csv) => (format!("Updating|{}|blank", table_name), csv.as_bytes()),
+            BatchOp::Query(table_name, query) => (format!("Querying|{}|{}", table_name, query), &[]),
+            BatchOp::Delete(table_name, query) => (format!("Deleting|{}|{}", table_name, query), &[]),
+            BatchOp::KvUpdate(key, value) => (format!("KvUpdate|{}|blank", key), value),
+        };
+        output.extend_from_slice(&(header.len() as u32).to_le_bytes());
+        output.extend_from_slice(header.as_bytes());
+        output.extend_from_slice(&(payload.len() as u64).to_le_bytes());
+        output.extend_from_slice(payload);
+    }
+    output
+}
+
+/// The inverse of serialize_batch. Any truncated or misshapen record fails the whole
+/// batch: partial execution of a half-parsed payload would be worse than a clean error.
+pub fn parse_batch(data: &[u8]) -> Result<Vec<BatchOp>, ServerError> {
+
+    fn malformed() -> ServerError {
+        ServerError::Instruction(InstructionError::Invalid("Malformed batch payload".to_owned()))
+    }
+
+    if data.len() < 4 {
+        return Err(malformed());
+    }
+    let op_count = u32::from_le_bytes(data[0..4].try_into().expect("4 byte slice always converts")) as usize;
+    let mut pos: usize = 4;
+    let mut ops: Vec<BatchOp> = Vec::with_capacity(op_count);
+    for _ in 0..op_count {
+        if pos + 4 > data.len() {
+            return Err(malformed());
+        }
+        let header_len = u32::from_le_bytes(data[pos..pos+4].try_into().expect("4 byte slice always converts")) as usize;
+        pos += 4;
+        if pos + header_len + 8 > data.len() {
+            return Err(malformed());
+        }
+        let header = match str::from_utf8(&data[pos..pos+header_len]) {
+            Ok(s) => s,
+            Err(_) => return Err(malformed()),
+        };
+        pos += header_len;
+        let payload_len = u64::from_le_bytes(data[pos..pos+8].try_into().expect("8 byte slice always converts")) as usize;
+        pos += 8;
+        if pos + payload_len > data.len() {
+            return Err(malformed());
+        }
+        let payload = &data[pos..pos+payload_len];
+        pos += payload_len;
+
+        // splitn so a query containing '|' keeps its tail.
+        let header_block: Vec<&str> = header.splitn(3, '|').collect();
+        if header_block.len() != 3 {
+            return Err(malformed());
+        }
+        let op = match header_block[0] {
+            "Updating" => BatchOp::Update(header_block[1].to_owned(), bytes_to_str(payload)?.to_owned()),
+            "Querying" => BatchOp::Query(header_block[1].to_owned(), header_block[2].to_owned()),
+            "Deleting" => BatchOp::Delete(header_block[1].to_owned(), header_block[2].to_owned()),
+            "KvUpdate" => BatchOp::KvUpdate(header_block[1].to_owned(), Vec::from(payload)),
+            other => return Err(ServerError::Instruction(InstructionError::Invalid(other.to_owned()))),
+        };
+        ops.push(op);
+    }
+
+    Ok(ops)
+}
+
+/// Packs the per-operation results of a batch into one response payload: a u32 count,
+/// then a u64 length and the utf8 result bytes per operation, in execution order.
+pub fn serialize_batch_responses(responses: &[String]) -> Vec<u8> {
+    let mut output: Vec<u8> = Vec::new();
+    output.extend_from_slice(&(responses.len() as u32).to_le_bytes());
+    for response in responses {
+        output.extend_from_slice(&(response.len() as u64).to_le_bytes());
+        output.extend_from_slice(response.as_bytes());
+    }
+    output
+}
+
+pub fn parse_batch_responses(data: &[u8]) -> Result<Vec<String>, ServerError> {
+
+    fn malformed() -> ServerError {
+        ServerError::Confirmation("Malformed batch response".to_owned())
+    }
+
+    if data.len() < 4 {
+        return Err(malformed());
+    }
+    let response_count = u32::from_le_bytes(data[0..4].try_into().expect("4 byte slice always converts")) as usize;
+    let mut pos: usize = 4;
+    let mut responses: Vec<String> = Vec::with_capacity(response_count);
+    for _ in 0..response_count {
+        if pos + 8 > data.len() {
+            return Err(malformed());
+        }
+        let response_len = u64::from_le_bytes(data[pos..pos+8].try_into().expect("8 byte slice always converts")) as usize;
+        pos += 8;
+        if pos + response_len > data.len() {
+            return Err(malformed());
+        }
+        match str::from_utf8(&data[pos..pos+response_len]) {
+            Ok(s) => responses.push(s.to_owned()),
+            Err(_) => return Err(malformed()),
+        };
+        pos += response_len;
+    }
+
+    Ok(responses)
 }
 
 #[derive(Debug, PartialEq, Clone)]
@@ -138,7 +292,11 @@ impl From<Utf8Error> for InstructionError {
 pub struct Connection {
     pub stream: TcpStream,
     pub user: String,
-    pub aes_key: Vec<u8>,   
+    pub aes_key: Vec<u8>,
+    /// The session ticket the server issued for this session, if any. Feed it to
+    /// Connection::resume together with the aes_key to reconnect without the asymmetric
+    /// handshake.
+    pub ticket: Option<[u8; 32]>,
 }
 
 impl Connection {
@@ -155,6 +313,7 @@ impl Connection {
         let mut key_buffer: [u8; 32] = [0u8;32];
         stream.read_exact(&mut key_buffer)?;
         let server_public_key = PublicKey::from(key_buffer);
+        stream.write_all(&[HANDSHAKE_FULL])?;
         stream.write_all(client_public_key.as_bytes())?;
         let shared_secret = client_private_key.diffie_hellman(&server_public_key);
         let aes_key = blake3_hash(&shared_secret.to_bytes());
@@ -165,7 +324,7 @@ impl Connection {
         // println!("auth_buffer: {:x?}", auth_buffer);
         
         let (encrypted_data, data_nonce) = encrypt_aes256(&auth_buffer, &aes_key);
-        println!("data_nonce: {:x?}", data_nonce);
+        debug_println!("data_nonce: {:x?}", data_nonce);
         // The reason for the +28 in the length checker is that it accounts for the length of the nonce (IV) and the authentication tag
         // in the aes-gcm encryption. The nonce is 12 bytes and the auth tag is 16 bytes
         let mut encrypted_data_block = Vec::with_capacity(encrypted_data.len() + 28);
@@ -179,12 +338,61 @@ impl Connection {
         stream.flush()?;
         stream.set_read_timeout(Some(Duration::from_secs(10)))?;
 
+        // A successful handshake is answered with an expiring session ticket, encrypted
+        // under the session key: 32 ticket bytes plus the 16 byte auth tag and 12 byte nonce.
+        let mut ticket_buffer = [0u8; 60];
+        stream.read_exact(&mut ticket_buffer)?;
+        let (ticket_ciphertext, ticket_nonce) = (&ticket_buffer[0..48], &ticket_buffer[48..]);
+        let ticket_plaintext = decrypt_aes256(ticket_ciphertext, &aes_key, ticket_nonce)?;
+        let mut ticket = [0u8; 32];
+        ticket.copy_from_slice(&ticket_plaintext);
+
         let user = username.to_owned();
         Ok(
             Connection {
                 stream: stream,
                 user: user,
                 aes_key: aes_key,
+                ticket: Some(ticket),
+            }
+        )
+
+    }
+
+    /// Resumes an encrypted session from a ticket issued by an earlier connect(). Skips
+    /// keygen, Diffie-Hellman, and the password check, which is what dominates the runtime
+    /// of short-lived jobs that reconnect constantly. The proof message encrypted under
+    /// the ticket's aes key is what authenticates the client.
+    pub fn resume(address: &str, username: &str, ticket: [u8; 32], aes_key: &[u8]) -> Result<Connection, ServerError> {
+
+        let mut stream = TcpStream::connect(address)?;
+        let mut key_buffer: [u8; 32] = [0u8;32];
+        stream.read_exact(&mut key_buffer)?;
+
+        let (proof, proof_nonce) = encrypt_aes256(RESUME_PROOF, aes_key);
+        let mut resume_block = Vec::with_capacity(1 + 32 + proof.len() + 12);
+        resume_block.push(HANDSHAKE_RESUME);
+        resume_block.extend_from_slice(&ticket);
+        resume_block.extend_from_slice(&proof);
+        resume_block.extend_from_slice(&proof_nonce);
+        stream.write_all(&resume_block)?;
+        stream.flush()?;
+
+        let mut accept_buffer = [0u8; 1];
+        stream.read_exact(&mut accept_buffer)?;
+        if accept_buffer[0] != 1 {
+            // Unknown, expired, or unproven ticket. The caller should fall back to a
+            // full Connection::connect.
+            return Err(ServerError::Authentication(AuthenticationError::Permission))
+        }
+        stream.set_read_timeout(Some(Duration::from_secs(10)))?;
+
+        Ok(
+            Connection {
+                stream: stream,
+                user: username.to_owned(),
+                aes_key: aes_key.to_vec(),
+                ticket: Some(ticket),
             }
         )
 
@@ -239,6 +447,66 @@ pub fn time_print(s: &str, cycles: u64) {
     println!("{}: {}\n\tApproximately {} milliseconds", s, num, millis);
 }
 
+/// Print that only exists in builds with the "debug_logging" feature. The request path
+/// used to println! several times per request which serializes every worker thread on
+/// the stdout lock. Use this for anything that runs per request, plain println! is still
+/// fine for startup and the save loop.
+#[macro_export]
+macro_rules! debug_println {
+    ($($arg:tt)*) => {{
+        #[cfg(feature = "debug_logging")]
+        {
+            println!($($arg)*);
+        }
+        #[cfg(not(feature = "debug_logging"))]
+        {
+            // Still "use" the arguments so the off build doesn't warn about them.
+            let _ = format_args!($($arg)*);
+        }
+    }};
+}
+
+/// Counters for what the server has done since it started. Everything is a relaxed
+/// atomic so the request path pays a few uncontended increments instead of taking a
+/// lock. Cycle counts come from rdtsc() and are cumulative across all workers.
+pub struct ServerStats {
+    pub instructions_served: AtomicU64,
+    pub bytes_sent: AtomicU64,
+    pub bytes_received: AtomicU64,
+    pub parse_cycles: AtomicU64,
+    pub crypto_cycles: AtomicU64,
+    pub handler_cycles: AtomicU64,
+}
+
+pub static SERVER_STATS: ServerStats = ServerStats {
+    instructions_served: AtomicU64::new(0),
+    bytes_sent: AtomicU64::new(0),
+    bytes_received: AtomicU64::new(0),
+    parse_cycles: AtomicU64::new(0),
+    crypto_cycles: AtomicU64::new(0),
+    handler_cycles: AtomicU64::new(0),
+};
+
+impl ServerStats {
+
+    #[inline(always)]
+    pub fn add(counter: &AtomicU64, amount: u64) {
+        counter.fetch_add(amount, Ordering::Relaxed);
+    }
+
+    /// One stat per line as "name|value", same pipe separator as the instruction format.
+    pub fn report(&self) -> String {
+        let mut printer = String::new();
+        printer.push_str(&format!("instructions_served|{}\n", self.instructions_served.load(Ordering::Relaxed)));
+        printer.push_str(&format!("bytes_sent|{}\n", self.bytes_sent.load(Ordering::Relaxed)));
+        printer.push_str(&format!("bytes_received|{}\n", self.bytes_received.load(Ordering::Relaxed)));
+        printer.push_str(&format!("parse_cycles|{}\n", self.parse_cycles.load(Ordering::Relaxed)));
+        printer.push_str(&format!("crypto_cycles|{}\n", self.crypto_cycles.load(Ordering::Relaxed)));
+        printer.push_str(&format!("handler_cycles|{}", self.handler_cycles.load(Ordering::Relaxed)));
+        printer
+    }
+}
+
 
 
 
@@ -324,12 +592,15 @@ pub fn instruction_send_and_confirm(instruction: Instruction, connection: &mut C
         Instruction::Upload(table_name) => format!("Uploading|{}|blank|{}", table_name, connection.user),
         Instruction::Update(table_name) => format!("Updating|{}|blank|{}", table_name, connection.user),
         Instruction::Query(table_name, query) => format!("Querying|{}|{}|{}", table_name, query, connection.user),
+        Instruction::Delete(table_name, query) => format!("Deleting|{}|{}|{}", table_name, query, connection.user),
         Instruction::NewUser(user_string) => format!("NewUser|{}|blank|{}", user_string, connection.user),
         Instruction::KvUpload(table_name) => format!("KvUpload|{}|blank|{}", table_name, connection.user),
         Instruction::KvUpdate(table_name) => format!("KvUpdate|{}|blank|{}", table_name, connection.user),
         Instruction::KvDownload(table_name) => format!("KvDownload|{}|blank|{}", table_name, connection.user),
         Instruction::MetaListTables => format!("MetaListTables|blank|blank|{}", connection.user),
         Instruction::MetaListKeyValues => format!("MetaListKeyValues|blank|blank|{}", connection.user),
+        Instruction::MetaStats => format!("MetaStats|blank|blank|{}", connection.user),
+        Instruction::Batch => format!("Batch|blank|blank|{}", connection.user),
 
     };
 
@@ -344,7 +615,7 @@ pub fn instruction_send_and_confirm(instruction: Instruction, connection: &mut C
 
     // // println!("encrypted instructions.len(): {}", encrypted_instructions.len());
     match connection.stream.write(&encrypted_data_block) {
-        Ok(n) => println!("Wrote request as {n} bytes"),
+        Ok(n) => debug_println!("Wrote request as {n} bytes"),
         Err(e) => {return Err(ServerError::Io(e.kind()));},
     };
     connection.stream.flush()?;
@@ -355,7 +626,7 @@ pub fn instruction_send_and_confirm(instruction: Instruction, connection: &mut C
     // println!("INSTRUCTION_BUFFER: {:x?}", buffer);
     // println!("About to parse response from server");
     let response = bytes_to_str(&buffer)?;
-    println!("reponse: {}", response);
+    debug_println!("reponse: {}", response);
     // println!("response: {}", response);
 
     Ok(response.to_owned())
@@ -382,40 +653,113 @@ pub fn parse_response(response: &str, username: &str, password: &[u8], table_nam
 
 pub fn data_send_and_confirm(connection: &mut Connection, data: &[u8]) -> Result<String, ServerError> {
 
-    // // println!("data: {:x?}", data);
-
-    let (encrypted_data, data_nonce) = encrypt_aes256(data, &connection.aes_key);
+    if data.len() > MAX_DATA_LEN {
+        return Err(ServerError::OversizedData)
+    }
 
-    let mut encrypted_data_block = Vec::with_capacity(data.len() + 28);
-    encrypted_data_block.extend_from_slice(&encrypted_data);
-    encrypted_data_block.extend_from_slice(&data_nonce);
+    // Large payloads are lz4 compressed before encryption. The csv-ish tables are
+    // redundant enough that this usually shrinks what goes over the wire several times
+    // over, which is what matters on a WAN link. Each frame is compressed on its own so
+    // the receiver can unpack them as they arrive instead of waiting for the last byte.
+    let codec = if data.len() >= COMPRESSION_THRESHOLD { COMPRESSION_LZ4 } else { COMPRESSION_NONE };
+
+    // Total plaintext length and codec first so the receiver can allocate once and knows
+    // when it has the whole payload and how to unpack the frames.
+    connection.stream.write_all(&(data.len() as u64).to_le_bytes())?;
+    connection.stream.write_all(&[codec])?;
+
+    // The payload is compressed and encrypted one DATA_BUFFER sized frame at a time with
+    // a fresh nonce per frame. Peak memory here is one frame's ciphertext instead of the
+    // old whole-table ciphertext plus two more staging copies.
+    // Each frame is its u32 length followed by ciphertext (with the 16 byte auth tag)
+    // and the 12 byte nonce.
+    let mut payload_bytes: u64 = 0;
+    for chunk in data.chunks(DATA_BUFFER) {
+        let crypto_start = rdtsc();
+        let compressed: Vec<u8>;
+        let chunk: &[u8] = if codec == COMPRESSION_LZ4 {
+            compressed = lz4_flex::compress_prepend_size(chunk);
+            &compressed
+        } else {
+            chunk
+        };
+        let (encrypted_chunk, nonce) = encrypt_aes256(chunk, &connection.aes_key);
+        ServerStats::add(&SERVER_STATS.crypto_cycles, rdtsc() - crypto_start);
+        let frame_len = (encrypted_chunk.len() + 12) as u32;
+        connection.stream.write_all(&frame_len.to_le_bytes())?;
+        connection.stream.write_all(&encrypted_chunk)?;
+        connection.stream.write_all(&nonce)?;
+        payload_bytes += chunk.len() as u64;
+    }
+    connection.stream.flush()?;
+    ServerStats::add(&SERVER_STATS.bytes_sent, payload_bytes);
 
-    // println!("encrypted data: {:x?}", encrypted_data_block);
-    // println!("Sending data...");
-    // The reason for the +28 in the length checker is that it accounts for the length of the nonce (IV) and the authentication tag
-    // in the aes-gcm encryption. The nonce is 12 bytes and the auth tag is 16 bytes
-    let mut block = Vec::from(&(data.len() + 28).to_le_bytes());
-    block.extend_from_slice(&encrypted_data_block);
-    connection.stream.write_all(&block)?;
-    // connection.stream.write_all(&(data.len() + 28).to_le_bytes())?;
-    // connection.stream.write_all(&encrypted_data_block)?;
-    
     // println!("data sent");
     let mut buffer: [u8;INSTRUCTION_BUFFER] = [0;INSTRUCTION_BUFFER];
     match connection.stream.read(&mut buffer) {
         Ok(_) => {
-            println!("Confirmation '{}' received", bytes_to_str(&buffer)?);
+            debug_println!("Confirmation '{}' received", bytes_to_str(&buffer)?);
         },
-        Err(_) => println!("Did not confirm transmission with peer"),
+        Err(_) => debug_println!("Did not confirm transmission with peer"),
     }
-    
+
     let confirmation = bytes_to_str(&buffer).unwrap_or("corrupt data");
     Ok(confirmation.to_owned())
 
 }
 
 
-pub fn receive_data(connection: &mut Connection) -> Result<(Vec<u8>, usize), ServerError> {
+/// Streams a file through the framed encrypted protocol without ever loading the whole
+/// body into memory: one DATA_BUFFER chunk is read from disk, encrypted, and written per
+/// frame. The wire format is identical to data_send_and_confirm, so receive_data on the
+/// other side cannot tell the difference.
+pub fn file_send_and_confirm(connection: &mut Connection, file: &mut std::fs::File, data_len: usize) -> Result<String, ServerError> {
+
+    if data_len > MAX_DATA_LEN {
+        return Err(ServerError::OversizedData)
+    }
+
+    connection.stream.write_all(&(data_len as u64).to_le_bytes())?;
+    // Spilled values are streamed straight from disk one chunk at a time, so they go
+    // uncompressed. Compressing here would mean buffering the whole file again.
+    connection.stream.write_all(&[COMPRESSION_NONE])?;
+
+    let mut chunk = vec![0u8; DATA_BUFFER];
+    let mut sent: usize = 0;
+    while sent < data_len {
+        let chunk_len = std::cmp::min(DATA_BUFFER, data_len - sent);
+        file.read_exact(&mut chunk[0..chunk_len])?;
+        let crypto_start = rdtsc();
+        let (encrypted_chunk, nonce) = encrypt_aes256(&chunk[0..chunk_len], &connection.aes_key);
+        ServerStats::add(&SERVER_STATS.crypto_cycles, rdtsc() - crypto_start);
+        let frame_len = (encrypted_chunk.len() + 12) as u32;
+        connection.stream.write_all(&frame_len.to_le_bytes())?;
+        connection.stream.write_all(&encrypted_chunk)?;
+        connection.stream.write_all(&nonce)?;
+        sent += chunk_len;
+    }
+    connection.stream.flush()?;
+    ServerStats::add(&SERVER_STATS.bytes_sent, data_len as u64);
+
+    let mut buffer: [u8;INSTRUCTION_BUFFER] = [0;INSTRUCTION_BUFFER];
+    match connection.stream.read(&mut buffer) {
+        Ok(_) => {
+            debug_println!("Confirmation '{}' received", bytes_to_str(&buffer)?);
+        },
+        Err(_) => debug_println!("Did not confirm transmission with peer"),
+    }
+
+    let confirmation = bytes_to_str(&buffer).unwrap_or("corrupt data");
+    Ok(confirmation.to_owned())
+
+}
+
+
+/// The streaming core of receive_data: every decrypted (and decompressed) plaintext chunk
+/// is handed to the sink as soon as its frame has arrived, so a caller can start working
+/// on the head of a payload while the tail is still on the wire. Returns the total
+/// plaintext length.
+pub fn receive_data_streaming(connection: &mut Connection, mut sink: impl FnMut(&[u8]) -> Result<(), ServerError>) -> Result<usize, ServerError> {
 
     let mut size_buffer: [u8; 8] = [0; 8];
     connection.stream.read_exact(&mut size_buffer)?;
@@ -424,25 +768,61 @@ pub fn receive_data(connection: &mut Connection) -> Result<(Vec<u8>, usize), Ser
     if data_len > MAX_DATA_LEN {
         return Err(ServerError::OversizedData)
     }
-    
-    let mut data = Vec::with_capacity(data_len);
-    let mut buffer = [0; DATA_BUFFER];
+
+    let mut codec_buffer: [u8; 1] = [0; 1];
+    connection.stream.read_exact(&mut codec_buffer)?;
+    let codec = codec_buffer[0];
+    if codec != COMPRESSION_NONE && codec != COMPRESSION_LZ4 {
+        return Err(ServerError::Confirmation(format!("Unknown compression codec: {}", codec)));
+    }
+
+    // A compressed frame of incompressible data can come out slightly bigger than the
+    // DATA_BUFFER of plaintext it carries, hence the slack in the bound.
+    let max_frame_len = DATA_BUFFER + DATA_BUFFER / 255 + 64;
+    let mut frame: Vec<u8> = Vec::with_capacity(DATA_BUFFER + 28);
     let mut total_read: usize = 0;
-    
+
+    // Frames are decrypted as they arrive so only one frame's ciphertext is ever
+    // resident at a time.
     while total_read < data_len {
-        let to_read = std::cmp::min(DATA_BUFFER, data_len - total_read);
-        let bytes_received = connection.stream.read(&mut buffer[..to_read])?;
-        if bytes_received == 0 {
-            return Err(ServerError::Confirmation("Read failure".to_owned()));
+        let mut frame_len_buffer: [u8; 4] = [0; 4];
+        connection.stream.read_exact(&mut frame_len_buffer)?;
+        let frame_len = u32::from_le_bytes(frame_len_buffer) as usize;
+        if frame_len < 12 || frame_len > max_frame_len {
+            return Err(ServerError::Confirmation("Invalid frame length".to_owned()));
         }
-        data.extend_from_slice(&buffer[..bytes_received]);
-        total_read += bytes_received;
-        println!("Total read: {}", total_read);
+        frame.resize(frame_len, 0);
+        connection.stream.read_exact(&mut frame)?;
+
+        let (ciphertext, nonce) = (&frame[0..frame_len-12], &frame[frame_len-12..]);
+        let crypto_start = rdtsc();
+        let mut plaintext = decrypt_aes256(ciphertext, &connection.aes_key, nonce)?;
+        if codec == COMPRESSION_LZ4 {
+            plaintext = match lz4_flex::decompress_size_prepended(&plaintext) {
+                Ok(decompressed) => decompressed,
+                Err(e) => return Err(ServerError::Confirmation(format!("Corrupt compressed payload: {}", e))),
+            };
+        }
+        ServerStats::add(&SERVER_STATS.crypto_cycles, rdtsc() - crypto_start);
+        total_read += plaintext.len();
+        sink(&plaintext)?;
+        debug_println!("Total read: {}", total_read);
     }
-    
-    let (ciphertext, nonce) = (&data[0..data.len()-12], &data[data.len()-12..]);
-    let csv = decrypt_aes256(&ciphertext, &connection.aes_key, nonce)?;
-    Ok((csv, total_read))
+
+    ServerStats::add(&SERVER_STATS.bytes_received, total_read as u64);
+    Ok(total_read)
+}
+
+
+pub fn receive_data(connection: &mut Connection) -> Result<(Vec<u8>, usize), ServerError> {
+
+    let mut data: Vec<u8> = Vec::new();
+    let total_read = receive_data_streaming(connection, |chunk| {
+        data.extend_from_slice(chunk);
+        Ok(())
+    })?;
+
+    Ok((data, total_read))
 }
 
 
@@ -458,5 +838,23 @@ mod tests {
         assert_eq!("123", x);
     }
 
+    #[test]
+    fn test_batch_serialization_roundtrip() {
+        let ops = vec![
+            BatchOp::Update("products".to_owned(), "vnr,text-p;magn,int\n0113000;5\n".to_owned()),
+            BatchOp::Query("products".to_owned(), "0113000..0113060".to_owned()),
+            BatchOp::Delete("products".to_owned(), "0113000".to_owned()),
+            BatchOp::KvUpdate("blob".to_owned(), vec![1, 2, 3]),
+        ];
+        assert_eq!(parse_batch(&serialize_batch(&ops)).unwrap(), ops);
+
+        let responses = vec!["OK".to_owned(), "some;csv\nrows;here".to_owned(), "ERROR: No such table".to_owned()];
+        assert_eq!(parse_batch_responses(&serialize_batch_responses(&responses)).unwrap(), responses);
+
+        // A truncated payload must fail as a whole, not half-parse.
+        let serialized = serialize_batch(&ops);
+        assert!(parse_batch(&serialized[0..serialized.len()-2]).is_err());
+    }
+
 
 }
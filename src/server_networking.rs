@@ -1,7 +1,7 @@
-use std::collections::HashMap;
+use std::collections::{BTreeSet, HashMap, HashSet};
 use std::io::{Write, Read};
-use std::net::TcpListener;
-use std::sync::{Arc, Mutex};
+use std::net::{TcpListener, TcpStream};
+use std::sync::{Arc, Condvar, Mutex, RwLock};
 use std::str::{self};
 
 use smartstring::{SmartString, LazyCompact};
@@ -9,35 +9,363 @@ use x25519_dalek::{StaticSecret, PublicKey};
 
 pub type KeyString = SmartString<LazyCompact>;
 
-use crate::aes_temp_crypto::decrypt_aes256;
+use crate::aes_temp_crypto::{decrypt_aes256, encrypt_aes256};
 use crate::auth::{User, AuthenticationError, user_has_permission};
+use crate::debug_println;
 use crate::networking_utilities::*;
-use crate::db_structure::{ColumnTable, StrictError, Value};
+use crate::db_structure::{read_from_disk, ColumnTable, StrictError, Value, BIN_TABLE_MAGIC, TOMBSTONE_COMPACT_RATIO};
 use crate::handlers::*;
 
 pub const CONFIG_FOLDER: &str = "EZconfig/";
+pub const WAL_PATH: &str = "EZconfig/wal";
 
+pub const WAL_OP_UPDATE: u8 = 1;
+pub const WAL_OP_KV_UPDATE: u8 = 2;
+pub const WAL_OP_DELETE: u8 = 3;
 
-pub fn parse_instruction(instructions: &[u8], users: Arc<Mutex<HashMap<KeyString, User>>>, global_tables: Arc<Mutex<HashMap<KeyString, ColumnTable>>>, global_kv_table: Arc<Mutex<HashMap<KeyString, Value>>>, aes_key: &[u8]) -> Result<Instruction, ServerError> {
+/// How many accepted connections may wait for a free worker before the accept loop blocks.
+pub const CONNECTION_QUEUE_LIMIT: usize = 64;
 
-    println!("Decrypting instructions");
+/// How long a persistent session may sit idle between instructions before the server drops
+/// it. The pool is bounded, so without this a handful of silent clients pin every worker.
+pub const SESSION_IDLE_TIMEOUT_SECS: u64 = 30;
+
+/// How many bytes of tables may stay loaded in memory before the eviction pass starts
+/// dropping the least recently accessed ones. Overridable with EZDB_TABLE_CACHE_BYTES.
+pub const DEFAULT_TABLE_CACHE_BYTES: usize = 1_000_000_000;
+
+/// The set of tables currently being parsed from disk, plus a condvar to wake the requests
+/// that are waiting for one of those parses to finish.
+pub type TableLoadCoordinator = Arc<(Mutex<HashSet<KeyString>>, Condvar)>;
+
+/// One issued session ticket: the session key it resumes, the user it authenticates as,
+/// and the time after which it stops working.
+pub struct SessionTicket {
+    pub aes_key: Vec<u8>,
+    pub user: String,
+    pub expires: u64,
+}
+
+/// Issued tickets keyed by their 32 random bytes. Read-mostly: a reconnect storm only
+/// takes read locks, which run in parallel; the write lock is taken when a full handshake
+/// issues a new ticket and when the save loop sweeps out expired ones. None of this ever
+/// touches the users Mutex.
+pub type SessionTickets = Arc<RwLock<HashMap<[u8; 32], SessionTicket>>>;
+
+/// The names of every table and key-value entry the server knows about, in memory or on
+/// disk. Kept sorted so the metadata listings are a brief read lock and a join instead of
+/// a directory scan per request - monitoring polls them every few seconds. Filled from
+/// CONFIG_FOLDER once at startup and maintained by the upload paths from there; a cache
+/// eviction leaves the name in place since the table is still on disk.
+pub struct TableCatalog {
+    tables: RwLock<BTreeSet<KeyString>>,
+    key_values: RwLock<BTreeSet<KeyString>>,
+}
+
+pub static TABLE_CATALOG: TableCatalog = TableCatalog {
+    tables: RwLock::new(BTreeSet::new()),
+    key_values: RwLock::new(BTreeSet::new()),
+};
+
+impl TableCatalog {
+
+    pub fn add_table(&self, name: &str) {
+        self.tables.write().unwrap().insert(KeyString::from(name));
+    }
+
+    pub fn add_key_value(&self, name: &str) {
+        self.key_values.write().unwrap().insert(KeyString::from(name));
+    }
+
+    /// One table name per line, in sorted order.
+    pub fn list_tables(&self) -> String {
+        Self::render(&self.tables)
+    }
+
+    /// One key per line, in sorted order.
+    pub fn list_key_values(&self) -> String {
+        Self::render(&self.key_values)
+    }
+
+    fn render(set: &RwLock<BTreeSet<KeyString>>) -> String {
+        let lock = set.read().unwrap();
+        let mut printer = String::new();
+        for name in lock.iter() {
+            printer.push_str(name);
+            printer.push('\n');
+        }
+        printer
+    }
+
+    /// Rescans the config folder and merges the result into the name sets. Called once at
+    /// startup; call it again if the folder is changed behind the server's back. Names
+    /// already in the catalog stay, so a table uploaded but not yet saved is still listed.
+    pub fn refresh_from_disk(&self) {
+        Self::refresh_one(&self.tables, &format!("{}raw_tables", CONFIG_FOLDER));
+        Self::refresh_one(&self.key_values, &format!("{}key_value", CONFIG_FOLDER));
+    }
+
+    fn refresh_one(set: &RwLock<BTreeSet<KeyString>>, dir: &str) {
+        let mut fresh = BTreeSet::new();
+        if let Ok(entries) = std::fs::read_dir(dir) {
+            for entry in entries.flatten() {
+                if let Ok(name) = entry.file_name().into_string() {
+                    // Leftovers from interrupted atomic writes are not tables.
+                    if !name.ends_with(".tmp") {
+                        fresh.insert(KeyString::from(name.as_str()));
+                    }
+                }
+            }
+        }
+        let mut lock = set.write().unwrap();
+        fresh.extend(std::mem::take(&mut *lock));
+        *lock = fresh;
+    }
+}
+
+/// Loads a table file from the config folder, decompressing it if the save loop wrote it
+/// compressed. Snapshots in the binary columnar format parse with bulk column reads, so
+/// loading is bounded by disk bandwidth rather than parse CPU; files from before the
+/// binary snapshots existed (or hand-placed csv) still parse as csv.
+fn load_table_from_disk(table_name: &str, created_by: &str) -> Result<ColumnTable, StrictError> {
+    let bytes = read_from_disk(&format!("{}raw_tables/{}", CONFIG_FOLDER, table_name))?;
+    if bytes.len() >= BIN_TABLE_MAGIC.len() && &bytes[0..BIN_TABLE_MAGIC.len()] == BIN_TABLE_MAGIC {
+        ColumnTable::from_binary(&bytes, table_name, created_by)
+    } else {
+        match String::from_utf8(bytes) {
+            Ok(csv) => ColumnTable::from_csv_string(&csv, table_name, created_by),
+            Err(_) => Err(StrictError::BinaryFormat(0)),
+        }
+    }
+}
+
+/// Fetches a table from the in-memory catalog, lazily loading it from disk if it is not
+/// there. The csv is read and parsed without holding the catalog lock, so only requests for
+/// the still-loading table wait; the loading set makes sure concurrent requests for the same
+/// table wait for one parse instead of each doing their own. Returns None if the table
+/// exists neither in memory nor on disk.
+pub fn get_or_load_table(global_tables: &GlobalTables, table_loading: &TableLoadCoordinator, table_name: &str) -> Result<Option<Arc<RwLock<ColumnTable>>>, ServerError> {
+    let (loading_set, loading_condvar) = &**table_loading;
+    {
+        let mut loading_lock = loading_set.lock().unwrap();
+        loop {
+            if let Some(table) = global_tables.read().unwrap().get(table_name) {
+                return Ok(Some(table.clone()))
+            }
+            if loading_lock.contains(table_name) {
+                // Another request is already parsing this table. Wait for it to finish.
+                loading_lock = loading_condvar.wait(loading_lock).unwrap();
+            } else {
+                loading_lock.insert(KeyString::from(table_name));
+                break
+            }
+        }
+    }
+
+    // This request owns the load now and must clear the loading set when done, success or not.
+    let result = match load_table_from_disk(table_name, "temp") {
+        Ok(table) => {
+            println!("Loaded table '{}' from disk", table_name);
+            let table = Arc::new(RwLock::new(table));
+            global_tables.write().unwrap().insert(KeyString::from(table_name), table.clone());
+            Ok(Some(table))
+        },
+        // An unreadable file means the table does not exist on disk; a file that read
+        // fine but failed to parse is a real error.
+        Err(StrictError::Io(_)) => Ok(None),
+        Err(e) => Err(ServerError::Strict(e)),
+    };
+
+    let mut loading_lock = loading_set.lock().unwrap();
+    loading_lock.remove(table_name);
+    loading_condvar.notify_all();
+    drop(loading_lock);
+
+    result
+}
+
+/// Append-only write-ahead log. Update handlers append the decrypted update payload
+/// here before applying it, so an accepted write survives a crash even if the 10 second
+/// save loop has not persisted the table yet. The save loop truncates the log after a
+/// successful checkpoint pass and Server::init replays whatever is left on startup.
+pub struct Wal {
+    file: std::fs::File,
+}
+
+impl Wal {
+    pub fn open(path: &str) -> Result<Wal, ServerError> {
+        let file = match std::fs::OpenOptions::new().read(true).append(true).create(true).open(path) {
+            Ok(f) => f,
+            Err(e) => return Err(ServerError::Io(e.kind())),
+        };
+        Ok(Wal { file: file })
+    }
+
+    /// Appends one update record and syncs it so the write is durable before it is applied.
+    /// Record layout: u8 op, u32 name length, name bytes, u64 payload length, payload bytes.
+    pub fn append(&mut self, op: u8, name: &str, payload: &[u8]) -> Result<(), ServerError> {
+        let mut record = Vec::with_capacity(13 + name.len() + payload.len());
+        record.push(op);
+        record.extend_from_slice(&(name.len() as u32).to_le_bytes());
+        record.extend_from_slice(name.as_bytes());
+        record.extend_from_slice(&(payload.len() as u64).to_le_bytes());
+        record.extend_from_slice(payload);
+        self.file.write_all(&record)?;
+        self.file.sync_data()?;
+        Ok(())
+    }
+
+    /// Discards all records. Only called after every table the log covers has been
+    /// checkpointed to disk.
+    pub fn truncate(&mut self) -> Result<(), ServerError> {
+        self.file.set_len(0)?;
+        Ok(())
+    }
+}
+
+/// Replays the write-ahead log into the given catalog and KV map. Called on startup so
+/// updates that were accepted but never checkpointed are not lost.
+fn replay_wal(path: &str, global_tables: &GlobalTables, global_kv_table: &GlobalKv) -> Result<(), ServerError> {
+
+    let log = match std::fs::read(path) {
+        Ok(l) => l,
+        Err(_) => return Ok(()),
+    };
+    if log.is_empty() {
+        return Ok(())
+    }
+    println!("Replaying {} bytes of write-ahead log", log.len());
+
+    let mut pos: usize = 0;
+    while pos + 13 <= log.len() {
+        let op = log[pos];
+        pos += 1;
+        let name_len = u32::from_le_bytes(log[pos..pos+4].try_into().expect("4 byte slice always converts")) as usize;
+        pos += 4;
+        if pos + name_len + 8 > log.len() {
+            println!("Write-ahead log ends mid-record. Stopping replay");
+            break
+        }
+        let name = match str::from_utf8(&log[pos..pos+name_len]) {
+            Ok(s) => s,
+            Err(_) => {
+                println!("Corrupt name in write-ahead log. Stopping replay");
+                break
+            },
+        };
+        pos += name_len;
+        let payload_len = u64::from_le_bytes(log[pos..pos+8].try_into().expect("8 byte slice always converts")) as usize;
+        pos += 8;
+        if pos + payload_len > log.len() {
+            println!("Write-ahead log ends mid-record. Stopping replay");
+            break
+        }
+        let payload = &log[pos..pos+payload_len];
+        pos += payload_len;
+
+        match op {
+            WAL_OP_UPDATE => {
+                let table = {
+                    let catalog = global_tables.read().unwrap();
+                    catalog.get(name).cloned()
+                };
+                let table = match table {
+                    Some(t) => t,
+                    None => {
+                        let disk_table = match load_table_from_disk(name, "wal_replay") {
+                            Ok(t) => Arc::new(RwLock::new(t)),
+                            Err(StrictError::Io(_)) => {
+                                println!("Write-ahead log references unknown table '{}'. Skipping record", name);
+                                continue
+                            },
+                            Err(e) => return Err(e.into()),
+                        };
+                        global_tables.write().unwrap().insert(KeyString::from(name), disk_table.clone());
+                        disk_table
+                    },
+                };
+                match table.write().unwrap().update_from_csv(bytes_to_str(payload)?) {
+                    Ok(_) => (),
+                    Err(e) => println!("Failed to replay update of table '{}' because: {}", name, e),
+                };
+            },
+            WAL_OP_DELETE => {
+                let table = {
+                    let catalog = global_tables.read().unwrap();
+                    catalog.get(name).cloned()
+                };
+                let table = match table {
+                    Some(t) => t,
+                    None => {
+                        let disk_table = match load_table_from_disk(name, "wal_replay") {
+                            Ok(t) => Arc::new(RwLock::new(t)),
+                            Err(StrictError::Io(_)) => {
+                                println!("Write-ahead log references unknown table '{}'. Skipping record", name);
+                                continue
+                            },
+                            Err(e) => return Err(e.into()),
+                        };
+                        global_tables.write().unwrap().insert(KeyString::from(name), disk_table.clone());
+                        disk_table
+                    },
+                };
+                let query = match str::from_utf8(payload) {
+                    Ok(s) => s,
+                    Err(_) => {
+                        println!("Corrupt delete query in write-ahead log. Stopping replay");
+                        break
+                    },
+                };
+                let result = if query.find("..").is_some() {
+                    let parsed_query: Vec<&str> = query.split("..").collect();
+                    table.write().unwrap().delete_range((parsed_query[0], parsed_query[1]))
+                } else {
+                    table.write().unwrap().delete_list(query.split(',').collect())
+                };
+                match result {
+                    Ok(_) => (),
+                    Err(e) => println!("Failed to replay delete on table '{}' because: {}", name, e),
+                };
+            },
+            WAL_OP_KV_UPDATE => {
+                let value = Value::new("wal_replay", payload);
+                // insert() carries the mutation counter over from any old entry.
+                match global_kv_table.insert(name, value) {
+                    Ok(_) => (),
+                    Err(e) => println!("Failed to replay update of key '{}' because: {}", name, e),
+                };
+            },
+            _ => {
+                println!("Unknown op '{}' in write-ahead log. Stopping replay", op);
+                break
+            },
+        }
+    }
+
+    Ok(())
+}
+
+
+pub fn parse_instruction(instructions: &[u8], users: Arc<Mutex<HashMap<KeyString, User>>>, global_tables: GlobalTables, global_kv_table: GlobalKv, table_loading: &TableLoadCoordinator, aes_key: &[u8]) -> Result<Instruction, ServerError> {
+
+    debug_println!("Decrypting instructions");
     let ciphertext = &instructions[0..instructions.len()-12];
     let nonce = &instructions[instructions.len()-12..];
 
     let plaintext = decrypt_aes256(ciphertext, aes_key, nonce)?;
 
     let instruction = bytes_to_str(&plaintext)?;
-    println!("instruction: {}", instruction);
+    debug_println!("instruction: {}", instruction);
 
 
     let instruction_block: Vec<&str> = instruction.split('|').collect();
 
-    println!("parsing 2...");
+    debug_println!("parsing 2...");
     if instruction_block.len() != INSTRUCTION_LENGTH {
         return Err(ServerError::Instruction(InstructionError::Invalid("Wrong number of query fields. Query should be usernme, password, request, table_name, query(or blank)".to_owned())));
     }
     
-    println!("parsing 3...");
+    debug_println!("parsing 3...");
     let (
         action, 
         table_name,
@@ -54,10 +382,10 @@ pub fn parse_instruction(instructions: &[u8], users: Arc<Mutex<HashMap<KeyString
         return Err(ServerError::Instruction(InstructionError::InvalidTable("Table cannot be called 'All'".to_owned())));
     }
 
-    println!("parsing 4...");
+    debug_println!("parsing 4...");
     match action {
         "Querying" => {
-            if !global_tables.lock().unwrap().contains_key(table_name) {
+            if get_or_load_table(&global_tables, table_loading, table_name)?.is_none() {
                 return Err(ServerError::Instruction(InstructionError::InvalidTable(table_name.to_owned())));
             } else if user_has_permission(table_name, action, username, users) {
                 
@@ -75,45 +403,42 @@ pub fn parse_instruction(instructions: &[u8], users: Arc<Mutex<HashMap<KeyString
             }
         } 
         "Downloading" => {
-            if !global_tables.lock().unwrap().contains_key(table_name) {
-                let raw_table_exists = std::path::Path::new(&format!("{}/raw_tables/{}", CONFIG_FOLDER, table_name)).exists();
-                if raw_table_exists {
-                    println!("Loading table from disk");
-                    let mut temp = global_tables.lock().unwrap();
-                    let disk_table = std::fs::read_to_string(format!("{}/raw_tables/{}", CONFIG_FOLDER, table_name))?;
-                    let disk_table = ColumnTable::from_csv_string(&disk_table, table_name, "temp")?;
-                    temp.insert(KeyString::from(table_name), disk_table);
-                    Ok(Instruction::Download(table_name.to_owned()))
-                } else {
-                    return Err(ServerError::Instruction(InstructionError::InvalidTable(table_name.to_owned())));
-                }
+            if get_or_load_table(&global_tables, table_loading, table_name)?.is_none() {
+                return Err(ServerError::Instruction(InstructionError::InvalidTable(table_name.to_owned())));
             } else {
                 Ok(Instruction::Download(table_name.to_owned()))
             }
         },
         "Updating" => {
-            if !global_tables.lock().unwrap().contains_key(table_name) {
+            if get_or_load_table(&global_tables, table_loading, table_name)?.is_none() {
                 return Err(ServerError::Instruction(InstructionError::InvalidTable(table_name.to_owned())));
             } else {
                 Ok(Instruction::Update(table_name.to_owned()))
             }
         },
+        "Deleting" => {
+            if get_or_load_table(&global_tables, table_loading, table_name)?.is_none() {
+                return Err(ServerError::Instruction(InstructionError::InvalidTable(table_name.to_owned())));
+            } else {
+                Ok(Instruction::Delete(table_name.to_owned(), query.to_owned()))
+            }
+        },
         "KvUpload" => {
-            if global_kv_table.lock().unwrap().contains_key(table_name) {
+            if global_kv_table.contains_key(table_name) {
                 return Err(ServerError::Instruction(InstructionError::InvalidTable(format!("Entry '{}' already exists. Use 'update' instead", table_name))));
             } else {
                 Ok(Instruction::KvUpload(table_name.to_owned()))
             }
         },
         "KvUpdate" => {
-            if !global_kv_table.lock().unwrap().contains_key(table_name) {
+            if !global_kv_table.contains_key(table_name) {
                 return Err(ServerError::Instruction(InstructionError::InvalidTable(format!("Entry '{}' does not exist. Use 'upload' instead", table_name))));
             } else {
                 Ok(Instruction::KvUpdate(table_name.to_owned()))
             }
         },
         "KvDownload" => {
-            if !global_kv_table.lock().unwrap().contains_key(table_name) {
+            if !global_kv_table.contains_key(table_name) {
                 return Err(ServerError::Instruction(InstructionError::InvalidTable(format!("Entry does not exist. You asked for '{}'", table_name))));
             } else {
                 Ok(Instruction::KvDownload(table_name.to_owned()))
@@ -125,6 +450,13 @@ pub fn parse_instruction(instructions: &[u8], users: Arc<Mutex<HashMap<KeyString
         "MetaListKeyValues" => {
             Ok(Instruction::MetaListKeyValues)
         },
+        "MetaStats" => {
+            Ok(Instruction::MetaStats)
+        },
+        "Batch" => {
+            // Per-operation checks happen in handle_batch once the op list has arrived.
+            Ok(Instruction::Batch)
+        },
         _ => {return Err(ServerError::Instruction(InstructionError::Invalid(action.to_owned())));},
     }
 }
@@ -134,9 +466,10 @@ pub struct Server {
     public_key: PublicKey,
     private_key: StaticSecret,
     listener: TcpListener,
-    tables: Arc<Mutex<HashMap<KeyString, ColumnTable>>>,
-    kv_list: Arc<Mutex<HashMap<KeyString, Value>>>,
+    tables: GlobalTables,
+    kv_list: GlobalKv,
     users: HashMap<KeyString, User>,
+    wal: Arc<Mutex<Wal>>,
 }
 
 impl Server {
@@ -144,17 +477,35 @@ impl Server {
         println!("Starting server...\n###########################");
         let server_private_key = StaticSecret::random();
         let server_public_key = PublicKey::from(&server_private_key);
-        
+
         println!("Binding to address: {address}");
         let l = match TcpListener::bind(address) {
             Ok(value) => value,
             Err(e) => {return Err(ServerError::Io(e.kind()));},
         };
 
-        let global_tables: Arc<Mutex<HashMap<KeyString, ColumnTable>>> = Arc::new(Mutex::new(HashMap::new()));
-        let global_kv_table: Arc<Mutex<HashMap<KeyString, Value>>> = Arc::new(Mutex::new(HashMap::new()));
+        for dir in ["EZconfig", "EZconfig/raw_tables", "EZconfig/raw_tables-metadata", "EZconfig/key_value", "EZconfig/key_value-metadata"] {
+            std::fs::create_dir_all(dir).expect("Need IO access to initialize database");
+        }
+
+        let global_tables: GlobalTables = Arc::new(RwLock::new(HashMap::new()));
+        let global_kv_table: GlobalKv = Arc::new(KvStore::new());
         let users: HashMap<KeyString, User> = HashMap::new();
 
+        // Replay any updates that were logged but not checkpointed before the last shutdown.
+        replay_wal(WAL_PATH, &global_tables, &global_kv_table)?;
+        let wal = Wal::open(WAL_PATH)?;
+
+        // The listing catalog starts as the on-disk names plus whatever the replay just
+        // put in memory; the upload paths keep it current from here.
+        TABLE_CATALOG.refresh_from_disk();
+        for name in global_tables.read().unwrap().keys() {
+            TABLE_CATALOG.add_table(name);
+        }
+        for name in global_kv_table.keys() {
+            TABLE_CATALOG.add_key_value(&name);
+        }
+
         Ok(
             Server {
                 public_key: server_public_key,
@@ -163,6 +514,7 @@ impl Server {
                 tables: global_tables,
                 kv_list: global_kv_table,
                 users: users,
+                wal: Arc::new(Mutex::new(wal)),
             }
         )
     }
@@ -173,7 +525,7 @@ pub fn run_server(mut server: Server) -> Result<(), ServerError> {
     // #################################### STARTUP SEQUENCE #############################################
     
     println!("Reading users config into memory");
-    if std::path::Path::new("EZconfig").is_dir() {
+    if std::path::Path::new(&format!("{CONFIG_FOLDER}.users")).exists() {
         println!("config exists");
         let temp = std::fs::read_to_string(&format!("{CONFIG_FOLDER}.users"))?;
         for line in temp.lines() {
@@ -186,11 +538,6 @@ pub fn run_server(mut server: Server) -> Result<(), ServerError> {
     } else {
         println!("config does not exist");
         let temp = ron::to_string(&User::admin("admin", "admin")).unwrap();
-        std::fs::create_dir("EZconfig").expect("Need IO access to initialize database");
-        std::fs::create_dir("EZconfig/raw_tables").expect("Need IO access to initialize database");
-        std::fs::create_dir("EZconfig/raw_tables-metadata").expect("Need IO access to initialize database");
-        std::fs::create_dir("EZconfig/key_value").expect("Need IO access to initialize database");
-        std::fs::create_dir("EZconfig/key_value-metadata").expect("Need IO access to initialize database");
         let mut user_file = match std::fs::File::create(format!("{CONFIG_FOLDER}.users")) {
             Ok(f) => f,
             Err(e) => return Err(ServerError::Strict(StrictError::Io(e.kind()))),
@@ -209,27 +556,145 @@ pub fn run_server(mut server: Server) -> Result<(), ServerError> {
     } 
 
     dbg!(&server.users);
-    
+
     let users = Arc::new(Mutex::new(server.users));
 
+    let table_cache_budget = match std::env::var("EZDB_TABLE_CACHE_BYTES") {
+        Ok(s) => match s.parse::<usize>() {
+            Ok(n) if n > 0 => n,
+            _ => {
+                println!("EZDB_TABLE_CACHE_BYTES is not a positive integer. Using {} bytes", DEFAULT_TABLE_CACHE_BYTES);
+                DEFAULT_TABLE_CACHE_BYTES
+            },
+        },
+        Err(_) => DEFAULT_TABLE_CACHE_BYTES,
+    };
+
+    // Parse the persisted tables into memory across all cores before serving, so the first
+    // request against each big table does not eat a cold multi-second parse. Largest files
+    // first, stopping at the cache budget, so the budget cut skips the small tables rather
+    // than the big ones. --no-preload (or EZDB_NO_PRELOAD) keeps the fast start for dev boxes.
+    let no_preload = std::env::args().any(|arg| arg == "--no-preload") || std::env::var("EZDB_NO_PRELOAD").is_ok();
+    if !no_preload {
+        let mut preload_files: Vec<(u64, KeyString)> = Vec::new();
+        if let Ok(dir) = std::fs::read_dir(format!("{}raw_tables", CONFIG_FOLDER)) {
+            for entry in dir {
+                let entry = match entry {
+                    Ok(e) => e,
+                    Err(_) => continue,
+                };
+                let size = match entry.metadata() {
+                    Ok(m) => m.len(),
+                    Err(_) => continue,
+                };
+                let name = match entry.file_name().into_string() {
+                    Ok(n) => n,
+                    Err(_) => continue,
+                };
+                if name.ends_with(".tmp") {
+                    continue
+                }
+                preload_files.push((size, KeyString::from(name.as_str())));
+            }
+        }
+        preload_files.sort_by(|a, b| b.0.cmp(&a.0));
+
+        let mut budgeted: Vec<KeyString> = Vec::new();
+        let mut budgeted_bytes: u64 = 0;
+        for (size, name) in preload_files {
+            if budgeted_bytes + size > table_cache_budget as u64 {
+                continue
+            }
+            budgeted_bytes += size;
+            budgeted.push(name);
+        }
+
+        if !budgeted.is_empty() {
+            let preload_start = std::time::Instant::now();
+            let preload_threads = std::thread::available_parallelism().map(|n| n.get()).unwrap_or(4);
+            let next_file = std::sync::atomic::AtomicUsize::new(0);
+            let preload_tables = &server.tables;
+            let budgeted_ref = &budgeted;
+            let next_file_ref = &next_file;
+            std::thread::scope(|scope| {
+                for _ in 0..preload_threads {
+                    scope.spawn(move || {
+                        loop {
+                            let i = next_file_ref.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+                            if i >= budgeted_ref.len() {
+                                break
+                            }
+                            let name = &budgeted_ref[i];
+                            match load_table_from_disk(name, "preload") {
+                                Ok(table) => {
+                                    preload_tables.write().unwrap().insert(name.clone(), Arc::new(RwLock::new(table)));
+                                },
+                                Err(e) => println!("Failed to preload table '{}' because: {}", name, e),
+                            }
+                        }
+                    });
+                }
+            });
+            println!("Preloaded {} tables ({} bytes on disk) in {:?}", budgeted.len(), budgeted_bytes, preload_start.elapsed());
+        }
+    }
+
     // #################################### END STARTUP SEQUENCE ###############################################
 
 
     // #################################### DATA SAVING AND LOADING LOOP ###################################################
 
+    let session_tickets: SessionTickets = Arc::new(RwLock::new(HashMap::new()));
+
     let data_saving_global_data = server.tables.clone();
     let data_saving_users = Arc::clone(&users);
     let data_saving_kv = server.kv_list.clone();
+    let data_saving_wal = server.wal.clone();
+    let data_saving_tickets = session_tickets.clone();
     std::thread::spawn(move || {
+        // The mutation counter of each table and value as of its last successful save.
+        // Anything whose counter still matches is clean and gets skipped this pass.
+        let mut saved_table_counters: HashMap<KeyString, u64> = HashMap::new();
+        let mut saved_kv_counters: HashMap<KeyString, u64> = HashMap::new();
         loop {
             std::thread::sleep(std::time::Duration::from_secs(10));
             println!("Background thread running good!...");
+            // Holding the WAL lock for the whole checkpoint pass keeps new updates from
+            // landing between the table saves and the log truncation below.
+            let mut wal_lock = data_saving_wal.lock().unwrap();
+
+            // Compact tables whose tombstone fraction has passed the threshold, so the
+            // checkpoint below persists the compacted form and queries stop paying for
+            // the dead rows.
             {
-                let data = data_saving_global_data.lock().unwrap();
+                let data = data_saving_global_data.read().unwrap();
                 for (name, table) in data.iter() {
-                    match table.save_to_disk_raw(CONFIG_FOLDER) {
-                        Ok(_) => (),
-                        Err(e) => println!("Unable to save table {} because: {}", name, e),
+                    let (dead, len) = {
+                        let table_lock = table.read().unwrap();
+                        (table_lock.tombstone_count(), table_lock.len())
+                    };
+                    if len > 0 && dead as f64 / len as f64 > TOMBSTONE_COMPACT_RATIO {
+                        let removed = table.write().unwrap().compact();
+                        println!("Compacted table '{}': removed {} tombstoned rows", name, removed);
+                    }
+                }
+            }
+
+            let mut checkpoint_clean = true;
+            {
+                let data = data_saving_global_data.read().unwrap();
+                for (name, table) in data.iter() {
+                    let table_lock = table.read().unwrap();
+                    let counter = table_lock.metadata.times_modified;
+                    if saved_table_counters.get(name) == Some(&counter) {
+                        continue
+                    }
+                    match table_lock.save_to_disk_raw(CONFIG_FOLDER) {
+                        Ok(_) => {saved_table_counters.insert(name.clone(), counter);},
+                        Err(e) => {
+                            checkpoint_clean = false;
+                            println!("Unable to save table {} because: {}", name, e);
+                        },
                     };
                 }
                 let user_lock = data_saving_users.lock().unwrap();
@@ -242,271 +707,587 @@ pub fn run_server(mut server: Server) -> Result<(), ServerError> {
             }
 
             {
-                let data = data_saving_kv.lock().unwrap();
-                for (key, value) in data.iter() {
-                    match value.save_to_disk_raw(key, CONFIG_FOLDER) {
-                        Ok(_) => (),
-                        Err(e) => println!("Unable to save value of key '{}' because: {}",key, e),
+                // Spilled values were written to disk when they were inserted, so only
+                // the resident ones need checkpointing here.
+                for (key, value) in data_saving_kv.resident_values() {
+                    let counter = value.metadata.times_modified;
+                    if saved_kv_counters.get(&key) == Some(&counter) {
+                        continue
+                    }
+                    match value.save_to_disk_raw(&key, CONFIG_FOLDER) {
+                        Ok(_) => {saved_kv_counters.insert(key.clone(), counter);},
+                        Err(e) => {
+                            checkpoint_clean = false;
+                            println!("Unable to save value of key '{}' because: {}",key, e);
+                        },
+                    };
+                }
+            }
+
+            if checkpoint_clean {
+                match wal_lock.truncate() {
+                    Ok(_) => (),
+                    Err(e) => println!("Unable to truncate write-ahead log because: {}", e),
+                };
+            }
+            drop(wal_lock);
+
+            // Sweep out expired session tickets so the map does not grow without bound.
+            let now = get_current_time();
+            data_saving_tickets.write().unwrap().retain(|_, ticket| ticket.expires > now);
+
+            // Keep the sum of loaded tables under the memory budget by dropping the least
+            // recently accessed ones. Only tables whose mutation counter still matches the
+            // checkpoint above are evicted, so nothing unsaved is ever dropped. Evicted
+            // tables come back lazily through get_or_load_table on their next request.
+            let mut total: usize = 0;
+            let mut candidates: Vec<(u64, KeyString, usize)> = Vec::new();
+            {
+                let data = data_saving_global_data.read().unwrap();
+                for (name, table) in data.iter() {
+                    let table_lock = table.read().unwrap();
+                    let size = table_lock.byte_size();
+                    total += size;
+                    candidates.push((table_lock.metadata.last_access, name.clone(), size));
+                }
+            }
+            if total > table_cache_budget {
+                candidates.sort();
+                let mut data = data_saving_global_data.write().unwrap();
+                for (_, name, size) in candidates {
+                    if total <= table_cache_budget {
+                        break
+                    }
+                    // The dirtiness check has to read the live counter under the map
+                    // write lock: an update applied through an already-cloned Arc after
+                    // candidate collection would otherwise slip past a stale snapshot
+                    // and the dirty table would be dropped with only a WAL entry left,
+                    // which the next clean checkpoint truncates.
+                    let live_counter = match data.get(&name) {
+                        Some(table) => {
+                            // A strong count above one means a handler still holds this
+                            // table and may be about to modify it. New handles need the
+                            // map lock held here, so count one plus a clean counter means
+                            // the table really is idle. Busy tables wait for a later pass.
+                            if Arc::strong_count(table) > 1 {
+                                continue
+                            }
+                            table.read().unwrap().metadata.times_modified
+                        },
+                        None => continue,
                     };
+                    if saved_table_counters.get(&name) != Some(&live_counter) {
+                        continue
+                    }
+                    println!("Evicting table '{}' ({} bytes) to stay under the cache budget", name, size);
+                    data.remove(&name);
+                    saved_table_counters.remove(&name);
+                    total -= size;
                 }
             }
         }
-    
+
     });
 
     // #################################### END DATA SAVING AND LOADING LOOP ###############################################
 
 
-    /* This is the main loop of the function. Here we accept incoming connections and process them */
+    // #################################### CONNECTION WORKER POOL #########################################
+
+    // A fixed pool of workers drains a bounded queue of accepted connections. When every
+    // worker is busy and the queue is full the accept loop blocks, so a connection burst
+    // backs up in the listener instead of spawning an unbounded number of threads.
+    let default_workers = std::thread::available_parallelism().map(|n| n.get()).unwrap_or(4);
+    let worker_count = match std::env::var("EZDB_WORKER_THREADS") {
+        Ok(s) => match s.parse::<usize>() {
+            Ok(n) if n > 0 => n,
+            _ => {
+                println!("EZDB_WORKER_THREADS is not a positive integer. Using {} workers", default_workers);
+                default_workers
+            },
+        },
+        Err(_) => default_workers,
+    };
+    println!("Serving connections with {} worker threads", worker_count);
+
+    let (connection_sender, connection_receiver) = std::sync::mpsc::sync_channel::<(TcpStream, std::net::SocketAddr)>(CONNECTION_QUEUE_LIMIT);
+    let connection_receiver = Arc::new(Mutex::new(connection_receiver));
+    let table_loading: TableLoadCoordinator = Arc::new((Mutex::new(HashSet::new()), Condvar::new()));
+
+    for _ in 0..worker_count {
+        let worker_receiver = connection_receiver.clone();
+        let worker_table_loading = table_loading.clone();
+        let worker_users = Arc::clone(&users);
+        let worker_global_tables = server.tables.clone();
+        let worker_global_kv_table = server.kv_list.clone();
+        let worker_wal = server.wal.clone();
+        let worker_session_tickets = session_tickets.clone();
+        let worker_public_key = server.public_key;
+        let worker_private_key = server.private_key.clone();
+
+        std::thread::spawn(move || {
+            let mut instruction_buffer: [u8; INSTRUCTION_BUFFER] = [0; INSTRUCTION_BUFFER];
+            loop {
+                let (stream, client_address) = {
+                    let receiver_lock = worker_receiver.lock().unwrap();
+                    match receiver_lock.recv() {
+                        Ok(queued) => queued,
+                        Err(_) => return,
+                    }
+                };
+                println!("Worker picked up connection from: {}", client_address);
+                // A handler panic must not shrink the pool: once every worker has died
+                // the accept loop's send fails and the whole server exits. Catch the
+                // unwind, drop the connection it happened on, and serve the next one.
+                let outcome = std::panic::catch_unwind(std::panic::AssertUnwindSafe(|| {
+                    serve_connection(stream, worker_users.clone(), worker_global_tables.clone(), worker_global_kv_table.clone(), worker_wal.clone(), &worker_table_loading, &worker_session_tickets, worker_public_key, &worker_private_key, &mut instruction_buffer);
+                }));
+                if outcome.is_err() {
+                    println!("Worker caught a panic while serving {}. Connection dropped", client_address);
+                }
+            }
+        });
+    }
+
+    // #################################### END CONNECTION WORKER POOL #####################################
+
+
+    /* This is the main loop of the function. Here we accept incoming connections and queue them for the workers */
     loop {
-        // Reading instructions
-        let (mut stream, client_address) = match server.listener.accept() {
+        let (stream, client_address) = match server.listener.accept() {
             Ok((n,m)) => (n, m),
             Err(e) => {return Err(ServerError::Io(e.kind()));},
         };
-        println!("Accepted connection from: {}", client_address);        
-        
-        let thread_global_tables = server.tables.clone();
-        let thread_global_kv_table = server.kv_list.clone();
-        let thread_users = Arc::clone(&users);
-        let thread_public_key = server.public_key;
-        let thread_private_key = server.private_key.clone();
+        println!("Accepted connection from: {}", client_address);
+
+        // send() blocks while the queue is full. This is the backpressure point.
+        match connection_sender.send((stream, client_address)) {
+            Ok(_) => (),
+            Err(_) => {
+                println!("All workers have shut down. Stopping server");
+                return Ok(())
+            },
+        }
+    }
+}
+
+
+/// Serves one accepted connection: key exchange, authentication, then the instruction loop.
+/// Runs on a pool worker. The instruction buffer is owned by the worker and reused across
+/// connections so a connection burst does not churn a fresh buffer per client.
+fn serve_connection(mut stream: TcpStream, users: Arc<Mutex<HashMap<KeyString, User>>>, global_tables: GlobalTables, global_kv_table: GlobalKv, wal: Arc<Mutex<Wal>>, table_loading: &TableLoadCoordinator, session_tickets: &SessionTickets, public_key: PublicKey, private_key: &StaticSecret, instruction_buffer: &mut [u8; INSTRUCTION_BUFFER]) {
+
+    // ################## ESTABLISHING ENCRYPTED CONNECTION ##########################################################################################################
+    match stream.write(public_key.as_bytes()) {
+        Ok(_) => (),
+        Err(e) => {
+            debug_println!("failed to write server public key because: {}", e);
+            return
+        }
+    }
+
+    // The first byte from the client says whether it wants a full handshake or wants to
+    // resume an earlier session from a ticket.
+    let mut handshake_kind: [u8; 1] = [0; 1];
+    match stream.read_exact(&mut handshake_kind) {
+        Ok(_) => (),
+        Err(e) => {
+            debug_println!("failed to read handshake type because: {}", e);
+            return
+        }
+    }
+
+    if handshake_kind[0] == HANDSHAKE_RESUME {
+        serve_resumed_connection(stream, users, global_tables, global_kv_table, wal, table_loading, session_tickets, instruction_buffer);
+        return
+    }
+
+    debug_println!("About to get crypto");
+    let mut buffer: [u8; 32] = [0; 32];
+
+    match stream.read_exact(&mut buffer){
+        Ok(_) => (),
+        Err(e) => {
+            debug_println!("failed to read client public key because: {}", e);
+            return
+        }
+    }
+
+    let client_public_key = PublicKey::from(buffer);
+    
+    let shared_secret = private_key.diffie_hellman(&client_public_key);
+    let aes_key = blake3_hash(shared_secret.as_bytes());
+
+    let mut auth_buffer = [0u8; 1052];
+    debug_println!("About to read auth string");
+    match stream.read_exact(&mut auth_buffer) {
+        Ok(_) => (),
+        Err(e) => {
+            debug_println!("failed to read auth_string because: {}", e);
+            return
+        }
+    }
+    // println!("encrypted auth_buffer: {:x?}", auth_buffer);
+    // println!("Encrypted auth_buffer.len(): {}", auth_buffer.len());
+
+    let (ciphertext, nonce) = (&auth_buffer[0..auth_buffer.len()-12], &auth_buffer[auth_buffer.len()-12..auth_buffer.len()]);
+    debug_println!("About to decrypt auth string");
+    let auth_string = match decrypt_aes256(ciphertext, &aes_key, nonce) {
+        Ok(s) => s,
+        Err(e) => {
+            debug_println!("failed to decrypt auth string because: {}", e);
+            return
+        }
+    };
+    debug_println!("About to parse auth_string");
+    let username = match bytes_to_str(&auth_string[0..512]) {
+        Ok(s) => s,
+        Err(e) => {
+            debug_println!("failed to read auth_string from bytes because: {}", e);
+            return
+        }
+    };
+    let password = &auth_string[512..];
+    debug_println!("password: {:?}", password);
+
+    // println!("username: {}\npassword: {:x?}", username, password);
+    let password = blake3_hash(bytes_to_str(password).unwrap().as_bytes());
+    debug_println!("password: {:?}", password);
+    // println!("password_hash: {:x?}", password);
+    debug_println!("About to verify username and password");
+    
+    let mut connection: Connection;
+    {
+        let users_lock = users.lock().unwrap();
+        if !users_lock.contains_key(username) {
+            debug_println!("users: {:?}", users_lock["admin"]);
+            debug_println!("Username:\n\t{}\n...is wrong", username);
+            return 
+        } else if users_lock[username].password != password {
+            debug_println!("users_lock[username].password: {:?}", users_lock[username].password);
+            debug_println!("password: {:?}", password);
+            debug_println!("Password hash:\n\t{:?}\n...is wrong", password);
+            return
+        }
         
+        connection = Connection {
+            stream: stream,
+            user: username.to_owned(),
+            aes_key: aes_key,
+            ticket: None,
+        };
+    }
 
-        // Spawn a thread to handle establishing connections
-        std::thread::spawn(move || {
+    // A successful handshake gets an expiring session ticket so this client's next
+    // connection can skip keygen, Diffie-Hellman, and the password check. The ticket
+    // goes over the wire encrypted under the session key.
+    let ticket: [u8; 32] = rand::random();
+    {
+        let mut tickets_lock = session_tickets.write().unwrap();
+        tickets_lock.insert(ticket, SessionTicket {
+            aes_key: connection.aes_key.clone(),
+            user: connection.user.clone(),
+            expires: get_current_time() + SESSION_TICKET_LIFETIME,
+        });
+    }
+    let (encrypted_ticket, ticket_nonce) = encrypt_aes256(&ticket, &connection.aes_key);
+    let mut ticket_block = Vec::with_capacity(encrypted_ticket.len() + 12);
+    ticket_block.extend_from_slice(&encrypted_ticket);
+    ticket_block.extend_from_slice(&ticket_nonce);
+    match connection.stream.write_all(&ticket_block) {
+        Ok(_) => (),
+        Err(e) => {
+            debug_println!("failed to send session ticket because: {}", e);
+            return
+        }
+    }
+    match connection.stream.flush() {
+        Ok(_) => (),
+        Err(e) => {
+            debug_println!("failed to flush session ticket because: {}", e);
+            return
+        }
+    }
 
-            // ################## ESTABLISHING ENCRYPTED CONNECTION ##########################################################################################################
-            match stream.write(thread_public_key.as_bytes()) {
-                Ok(_) => (),
-                Err(e) => {
-                    println!("failed to write server public key because: {}", e);
-                    return
-                }
-            }
-            println!("About to get crypto");
-            let mut buffer: [u8; 32] = [0; 32];
-            
-            match stream.read_exact(&mut buffer){
-                Ok(_) => (),
-                Err(e) => {
-                    println!("failed to read client public key because: {}", e);
-                    return
-                }
-            }
-            
-            let client_public_key = PublicKey::from(buffer);
-            
-            let shared_secret = thread_private_key.diffie_hellman(&client_public_key);
-            let aes_key = blake3_hash(shared_secret.as_bytes());
+    // ############################ END OF ESTABLISHING ENCRYPTED CONNECTION ###################################################################################
 
-            let mut auth_buffer = [0u8; 1052];
-            println!("About to read auth string");
-            match stream.read_exact(&mut auth_buffer) {
-                Ok(_) => (),
-                Err(e) => {
-                    println!("failed to read auth_string because: {}", e);
-                    return
-                }
-            }
-            // println!("encrypted auth_buffer: {:x?}", auth_buffer);
-            // println!("Encrypted auth_buffer.len(): {}", auth_buffer.len());
+    serve_instruction_loop(connection, users, global_tables, global_kv_table, wal, table_loading, instruction_buffer);
+}
 
-            let (ciphertext, nonce) = (&auth_buffer[0..auth_buffer.len()-12], &auth_buffer[auth_buffer.len()-12..auth_buffer.len()]);
-            println!("About to decrypt auth string");
-            let auth_string = match decrypt_aes256(ciphertext, &aes_key, nonce) {
-                Ok(s) => s,
-                Err(e) => {
-                    println!("failed to decrypt auth string because: {}", e);
-                    return
-                }
-            };
-            println!("About to parse auth_string");
-            let username = match bytes_to_str(&auth_string[0..512]) {
-                Ok(s) => s,
-                Err(e) => {
-                    println!("failed to read auth_string from bytes because: {}", e);
-                    return
-                }
-            };
-            let password = &auth_string[512..];
-            println!("password: {:?}", password);
-
-            // println!("username: {}\npassword: {:x?}", username, password);
-            let password = blake3_hash(bytes_to_str(password).unwrap().as_bytes());
-            println!("password: {:?}", password);
-            // println!("password_hash: {:x?}", password);
-            println!("About to verify username and password");
-            
-            let mut connection: Connection;
-            {
-                let thread_users_lock = thread_users.lock().unwrap();
-                if !thread_users_lock.contains_key(username) {
-                    println!("users: {:?}", thread_users_lock["admin"]);
-                    println!("Username:\n\t{}\n...is wrong", username);
-                    return 
-                } else if thread_users_lock[username].password != password {
-                    println!("thread_users_lock[username].password: {:?}", thread_users_lock[username].password);
-                    println!("password: {:?}", password);
-                    println!("Password hash:\n\t{:?}\n...is wrong", password);
-                    return
-                }
-                
-                connection = Connection {
-                    stream: stream, 
-                    user: username.to_owned(), 
-                    aes_key: aes_key
-                };
-            }
 
-            // ############################ END OF ESTABLISHING ENCRYPTED CONNECTION ###################################################################################
+/// Validates a session ticket and its proof of key ownership, then serves the resumed
+/// encrypted session. The ticket lookup only takes a read lock on the ticket map, so a
+/// storm of resuming batch jobs never serializes on the users Mutex.
+fn serve_resumed_connection(mut stream: TcpStream, users: Arc<Mutex<HashMap<KeyString, User>>>, global_tables: GlobalTables, global_kv_table: GlobalKv, wal: Arc<Mutex<Wal>>, table_loading: &TableLoadCoordinator, session_tickets: &SessionTickets, instruction_buffer: &mut [u8; INSTRUCTION_BUFFER]) {
 
+    // 32 ticket bytes, then RESUME_PROOF encrypted under the ticket's key (16 byte auth
+    // tag) followed by the 12 byte nonce.
+    let mut resume_buffer: [u8; 66] = [0; 66];
+    match stream.read_exact(&mut resume_buffer) {
+        Ok(_) => (),
+        Err(e) => {
+            debug_println!("failed to read resume block because: {}", e);
+            return
+        }
+    }
+    let mut ticket: [u8; 32] = [0; 32];
+    ticket.copy_from_slice(&resume_buffer[0..32]);
+    let (proof_ciphertext, proof_nonce) = (&resume_buffer[32..54], &resume_buffer[54..]);
 
-            // ############################ HANDLING REQUESTS ###########################################################################################################
-            let mut instruction_size = 0;
+    let resumed = {
+        let tickets_lock = session_tickets.read().unwrap();
+        match tickets_lock.get(&ticket) {
+            Some(entry) if entry.expires > get_current_time() => Some((entry.aes_key.clone(), entry.user.clone())),
+            _ => None,
+        }
+    };
+    let (aes_key, user) = match resumed {
+        Some(resumed) => resumed,
+        None => {
+            debug_println!("Rejected unknown or expired session ticket");
+            let _ = stream.write(&[0]);
+            return
+        },
+    };
 
-            let mut buffer: [u8; INSTRUCTION_BUFFER] = [0; INSTRUCTION_BUFFER];
-            println!("Initialized string buffer");
+    // The client has to prove it owns the session key, not just the ticket bytes.
+    match decrypt_aes256(proof_ciphertext, &aes_key, proof_nonce) {
+        Ok(proof) if proof == RESUME_PROOF => (),
+        _ => {
+            debug_println!("Rejected session resumption with bad key proof");
+            let _ = stream.write(&[0]);
+            return
+        },
+    }
+
+    match stream.write(&[1]) {
+        Ok(_) => (),
+        Err(e) => {
+            debug_println!("failed to accept session resumption because: {}", e);
+            return
+        }
+    }
+    match stream.flush() {
+        Ok(_) => (),
+        Err(e) => {
+            debug_println!("failed to accept session resumption because: {}", e);
+            return
+        }
+    }
+
+    let connection = Connection {
+        stream: stream,
+        user: user,
+        aes_key: aes_key,
+        ticket: Some(ticket),
+    };
+
+    serve_instruction_loop(connection, users, global_tables, global_kv_table, wal, table_loading, instruction_buffer);
+}
+
+
+/// The per-connection instruction loop, shared by freshly handshaken and resumed sessions.
+fn serve_instruction_loop(mut connection: Connection, users: Arc<Mutex<HashMap<KeyString, User>>>, global_tables: GlobalTables, global_kv_table: GlobalKv, wal: Arc<Mutex<Wal>>, table_loading: &TableLoadCoordinator, instruction_buffer: &mut [u8; INSTRUCTION_BUFFER]) {
+
+    // ############################ HANDLING REQUESTS ###########################################################################################################
+
+    // The connection stays alive after an instruction has been served so clients
+    // can pipeline many instructions over one encrypted session instead of paying
+    // connect + DH + auth per request. The worker serving it comes from a bounded
+    // pool though, so an idle session must not hold it forever: the read below
+    // times out and the session is dropped. The client falls back to a fresh
+    // connect or a ticket resume on its next instruction.
+    match connection.stream.set_read_timeout(Some(std::time::Duration::from_secs(SESSION_IDLE_TIMEOUT_SECS))) {
+        Ok(_) => (),
+        Err(e) => {
+            debug_println!("failed to set the session read timeout because: {}", e);
+            return
+        },
+    }
+
+    loop {
+
+    let instruction_size: usize;
+
+    match connection.stream.read(&mut instruction_buffer[..]) {
+        Ok(0) => {
+            debug_println!("Client closed the connection");
+            return
+        },
+        Ok(n) => instruction_size = n,
+        Err(e) if e.kind() == std::io::ErrorKind::WouldBlock || e.kind() == std::io::ErrorKind::TimedOut => {
+            debug_println!("Dropping a session that sat idle for {SESSION_IDLE_TIMEOUT_SECS} seconds");
+            return
+        },
+        Err(e) => {
+            debug_println!("There was an io error during a large read.\nError:\t{e}");
+            return
+        },
+    };
+
+    // println!("Instruction buffer[0..50]: {:x?}", &buffer[0..50]);
+    let instructions = &instruction_buffer[0..instruction_size];
+    debug_println!("Parsing instructions...");
+    let parse_start = rdtsc();
+    let parsed_instruction = parse_instruction(instructions, users.clone(), global_tables.clone(), global_kv_table.clone(), table_loading, &connection.aes_key);
+    ServerStats::add(&SERVER_STATS.parse_cycles, rdtsc() - parse_start);
+    let handler_start = rdtsc();
+    match parsed_instruction {
+        Ok(i) => match i {
             
-            while instruction_size == 0 {
-                match connection.stream.read(&mut buffer) {
-                    Ok(n) => instruction_size = n,
+            Instruction::Download(name) => {
+                match handle_download_request(&mut connection, &name, global_tables.clone(), table_loading) {
+                    Ok(_) => {
+                        debug_println!("Operation finished!");
+                    },
                     Err(e) => {
-                        println!("There was an io error during a large read.\nError:\t{e}");
-                        return
+                        debug_println!("Operation failed because: {}", e);
+                    }
+                }
+            },
+            Instruction::Upload(name) => {
+                match handle_upload_request(&mut connection, &name, global_tables.clone()) {
+                    Ok(_) => {
+                        debug_println!("Operation finished!");
                     },
-                };
-            }
-            
-            // println!("Instruction buffer[0..50]: {:x?}", &buffer[0..50]);
-            let instructions = &buffer[0..instruction_size];
-            println!("Parsing instructions...");
-            match parse_instruction(instructions, thread_users.clone(), thread_global_tables.clone(), thread_global_kv_table.clone(), &connection.aes_key) {
-                Ok(i) => match i {
-                    
-                    Instruction::Download(name) => {
-                        match handle_download_request(&mut connection, &name, thread_global_tables.clone()) {
-                            Ok(_) => {
-                                println!("Operation finished!");
-                            },
-                            Err(e) => {
-                                println!("Operation failed because: {}", e);
-                            }
-                        }
+                    Err(e) => {
+                        debug_println!("Operation failed because: {}", e);
+                    }
+                }
+            },
+            Instruction::Update(name) => {
+                match handle_update_request(&mut connection, &name, global_tables.clone(), wal.clone(), table_loading) {
+                    Ok(_) => {
+                        debug_println!("Operation finished!");
                     },
-                    Instruction::Upload(name) => {
-                        match handle_upload_request(&mut connection, &name, thread_global_tables.clone()) {
-                            Ok(_) => {
-                                println!("Operation finished!");
-                            },
-                            Err(e) => {
-                                println!("Operation failed because: {}", e);
-                            }
-                        }
+                    Err(e) => {
+                        debug_println!("Operation failed because: {}", e);
                     },
-                    Instruction::Update(name) => {
-                        match handle_update_request(&mut connection, &name, thread_global_tables.clone()) {
-                            Ok(_) => {
-                                println!("Operation finished!");
-                            },
-                            Err(e) => {
-                                println!("Operation failed because: {}", e);
-                            },
-                        }
+                }
+            },
+            Instruction::Query(table_name, query) => {
+                match handle_query_request(&mut connection, &table_name, &query, global_tables.clone(), table_loading) {
+                    Ok(_) => {
+                        debug_println!("Operation finished!");
                     },
-                    Instruction::Query(table_name, query) => {
-                        match handle_query_request(&mut connection, &table_name, &query, thread_global_tables.clone()) {
-                            Ok(_) => {
-                                println!("Operation finished!");
-                            },
-                            Err(e) => {
-                                println!("Operation failed because: {}", e);
-                            },
-                        }
+                    Err(e) => {
+                        debug_println!("Operation failed because: {}", e);
                     },
-                    Instruction::NewUser(user_string) => {
-                        match handle_new_user_request(&user_string, thread_users.clone()) {
-                            Ok(_) => {
-                                println!("New user added!");
-                            },
-                            Err(e) => {
-                                println!("Operation failed because: {}", e);
-                            },
-                        }
-                        
+                }
+            },
+            Instruction::Delete(table_name, query) => {
+                match handle_delete_request(&mut connection, &table_name, &query, global_tables.clone(), wal.clone(), table_loading) {
+                    Ok(_) => {
+                        debug_println!("Operation finished!");
                     },
-                    Instruction::KvUpload(table_name) => {
-                        let check_global_kv  = thread_global_kv_table.clone(); 
-                        match handle_kv_upload(&mut connection, &table_name, thread_global_kv_table.clone()) {
-                            Ok(_) => {
-                                println!("Operation finished!");
-                                println!("kv result: {:x?}", check_global_kv.lock().unwrap().get(&KeyString::from(table_name)).unwrap().body);
-                            },
-                            Err(e) => {
-                                println!("Operation failed because: {}", e);
-                            },
-                        }
+                    Err(e) => {
+                        debug_println!("Operation failed because: {}", e);
                     },
-                    Instruction::KvUpdate(table_name) => {
-                        match handle_kv_update(&mut connection, &table_name, thread_global_kv_table.clone()) {
-                            Ok(_) => {
-                                println!("Operation finished!");
-                            },
-                            Err(e) => {
-                                println!("Operation failed because: {}", e);
-                            },
-                        }
+                }
+            },
+            Instruction::NewUser(user_string) => {
+                match handle_new_user_request(&user_string, users.clone()) {
+                    Ok(_) => {
+                        debug_println!("New user added!");
                     },
-                    Instruction::KvDownload(table_name) => {
-                        match handle_kv_download(&mut connection, &table_name, thread_global_kv_table.clone()) {
-                            Ok(_) => {
-                                println!("Operation finished!");
-                            },
-                            Err(e) => {
-                                println!("Operation failed because: {}", e);
-                            },
-                        }
+                    Err(e) => {
+                        debug_println!("Operation failed because: {}", e);
                     },
-                    Instruction::MetaListTables => {
-                        match handle_meta_list_tables(&mut connection, thread_global_tables.clone()) {
-                            Ok(_) => {
-                                println!("Operation finished");
-                            },
-                            Err(e) => {
-                                println!("Operation failed because: {}", e);
-                            }
-                        }
+                }
+                
+            },
+            Instruction::KvUpload(table_name) => {
+                match handle_kv_upload(&mut connection, &table_name, global_kv_table.clone()) {
+                    Ok(_) => {
+                        debug_println!("Operation finished!");
+                        debug_println!("uploaded value under key '{}'", table_name);
+                    },
+                    Err(e) => {
+                        debug_println!("Operation failed because: {}", e);
+                    },
+                }
+            },
+            Instruction::KvUpdate(table_name) => {
+                match handle_kv_update(&mut connection, &table_name, global_kv_table.clone(), wal.clone()) {
+                    Ok(_) => {
+                        debug_println!("Operation finished!");
+                    },
+                    Err(e) => {
+                        debug_println!("Operation failed because: {}", e);
+                    },
+                }
+            },
+            Instruction::KvDownload(table_name) => {
+                match handle_kv_download(&mut connection, &table_name, global_kv_table.clone()) {
+                    Ok(_) => {
+                        debug_println!("Operation finished!");
+                    },
+                    Err(e) => {
+                        debug_println!("Operation failed because: {}", e);
+                    },
+                }
+            },
+            Instruction::MetaListTables => {
+                match handle_meta_list_tables(&mut connection) {
+                    Ok(_) => {
+                        debug_println!("Operation finished");
+                    },
+                    Err(e) => {
+                        debug_println!("Operation failed because: {}", e);
                     }
-                    Instruction::MetaListKeyValues => {
-                        match handle_meta_list_key_values(&mut connection, thread_global_kv_table.clone()) {
-                            Ok(_) => {
-                                println!("Operation finished");
-                            },
-                            Err(e) => {
-                                println!("Operation failed because: {}", e);
-                            }
-                        }
+                }
+            }
+            Instruction::MetaListKeyValues => {
+                match handle_meta_list_key_values(&mut connection) {
+                    Ok(_) => {
+                        debug_println!("Operation finished");
+                    },
+                    Err(e) => {
+                        debug_println!("Operation failed because: {}", e);
                     }
-                },
-                
-                Err(e) => {
-                    println!("Failed to serve request because: {e}");
-                    match connection.stream.write(e.to_string().as_bytes()){
-                        Ok(_) => (),
-                        Err(e) => {
-                            println!("failed to write error message because: {}", e);
-                        }
+                }
+            }
+            Instruction::MetaStats => {
+                match handle_meta_stats(&mut connection) {
+                    Ok(_) => {
+                        debug_println!("Operation finished");
+                    },
+                    Err(e) => {
+                        debug_println!("Operation failed because: {}", e);
                     }
-                    println!("Thread finished on error: {e}");
-                },
-                
-            };
+                }
+            }
+            Instruction::Batch => {
+                match handle_batch(&mut connection, users.clone(), global_tables.clone(), global_kv_table.clone(), wal.clone(), table_loading) {
+                    Ok(_) => {
+                        debug_println!("Operation finished");
+                    },
+                    Err(e) => {
+                        debug_println!("Operation failed because: {}", e);
+                    }
+                }
+            }
+        },
+        
+        Err(e) => {
+            debug_println!("Failed to serve request because: {e}");
+            match connection.stream.write(e.to_string().as_bytes()){
+                Ok(_) => (),
+                Err(e) => {
+                    debug_println!("failed to write error message because: {}", e);
+                }
+            }
+            debug_println!("Instruction finished on error: {e}");
+        },
 
-            //####################### END OF HANDLING REQUESTS #############################################################################################################
-        });
-        // END OF SERVER FUNCTION
+    };
+    ServerStats::add(&SERVER_STATS.handler_cycles, rdtsc() - handler_start);
+    ServerStats::add(&SERVER_STATS.instructions_served, 1);
 
-    }
+    } // End of the per-connection instruction loop
+
+    //####################### END OF HANDLING REQUESTS #############################################################################################################
 }
 
 
+